@@ -17,23 +17,74 @@
 #include <iostream>
 #include <string>
 #include <cmath>
+#include <cstdint>
+#include <complex>
+#include <numbers>
 #include <map>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <unordered_map>
 #include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <span>
+#include <thread>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <future>
+#include <optional>
+#include <bit>
+#include <array>
+#include <limits>
+#include <string_view>
+#include <charconv>
+#include <numeric>
+#include <fstream>
+#include <cstdio>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "third_party/cxx-prettyprint/prettyprint.hpp"
 
 // Trust Pooler namespace
 namespace tp
 {
-    // We need to balance within 1 cent for this exercise, can refactor to handle Wei as required
-    // Using doubles for this exercise, in production better to use uint64_t
+    // Amounts are fixed point integers in the smallest currency unit (eg Wei) so the books balance exactly
+    template <typename T>
     inline
-    bool Close(double a, double b )
+    bool Close( T a, T b )
     {
-        return fabs(a-b) < 0.01;
+        return a == b;
     }
+    
+    // a * b / c rounded down, for non negative fixed point amounts - c must not be 0, the callers check
+    // The product goes through 128 bits - if it fits in 64 we skip the slower 128 bit divide
+    inline
+    std::int64_t MulDiv( std::int64_t a, std::int64_t b, std::int64_t c )
+    {
+        assert( c != 0 );
+        std::int64_t product;
+        if ( !__builtin_mul_overflow( a, b, &product ) )    return product / c;
+        return (std::int64_t)( (__int128)a * b / c );
+    }
+    
+    // Fixed point 1 for the inverse distance to the pin - the weight for a distance d is InverseDistanceOne / d
+    // Weights are integers so the totals add up exactly in any order
+    constexpr std::int64_t InverseDistanceOne = std::int64_t{1} << 32;
 
-    enum class Side { Long, Short, Neither };
+    enum class Side : std::int32_t { Long, Short, Neither };   // Fixed width - the settlement kernels load it as int32
 
     // Just add void print(std::ostream& os ) const {} to an object and we can stream it
     // This works for any object - must be in the tp namespace
@@ -45,16 +96,54 @@ namespace tp
         return os;
     }
 
+    // Interns strings to dense ids - the first string we see is 0, the next 1 ...
+    struct InternTable
+    {
+        using Id = std::int32_t;
+        static constexpr Id None = -1;
+        
+        // Lets us look up a string_view without making a string
+        struct Hash
+        {
+            using is_transparent = void;
+            std::size_t operator()( std::string_view name ) const noexcept  { return std::hash<std::string_view>{}( name ); }
+        };
+        
+        std::vector<std::string>                                        names;  // Id -> name
+        std::unordered_map< std::string, Id, Hash, std::equal_to<> >    ids;    // name -> Id
+        
+        Id Intern( std::string_view name )
+        {
+            if ( auto it = ids.find( name ); it != ids.end() )  return it->second;
+            Id id = (Id)names.size();
+            names.emplace_back( name );
+            ids.emplace( name, id );
+            return id;
+        }
+        
+        // None if we have never seen it
+        Id Find( std::string_view name ) const
+        {
+            auto it = ids.find( name );
+            return it == ids.end() ? None : it->second;
+        }
+        
+        const std::string& Name( Id id ) const
+        {
+            return names[id];
+        }
+    };
+
     // Base class for a transaction - no constructor for this exercise
     struct DefaultTX
     {
         using TxId = int;           // Transaction id
-        using Amount = double;      // Amount we are risking
+        using Amount = std::int64_t;        // Amount we are risking - fixed point in the smallest unit eg Wei
+        using AccountId = InternTable::Id;  // Interned account name, crypto address - the pool keeps the names
         
         TxId        id{};           // Transaction id
         Amount      amount{};       // Amount of capital at risk
-        std::string client_account; // From account
-        std::string pool_account;   // Pool fee account
+        AccountId   client_account{ InternTable::None };   // From account - the pool's own account is PoolAccount(), once per pool
         Amount      payout{};       // How much are we paying out (absolute currency amount)?
         
         void print(std::ostream& os ) const
@@ -84,8 +173,10 @@ namespace tp
         using TxId = TX::TxId;
         using Amount = TX::Amount;
         using Level = std::string;
+        using Key = InternTable::Id;
         
         std::string     event;      // String identifier of event, for stronger typing use an enum
+        Key             outcome{ InternTable::None };   // Interned id of the event - the pool sets this in MakeRisk
         Tx              tx;         // Tx associated with this event
         
         MutexEvent()=default;
@@ -104,12 +195,19 @@ namespace tp
             return event == level;
         }
         
+        // Column friendly version on the interned ids - the pool scans with this without building the event
+        static constexpr
+        bool Wins( Side, Key outcome, Key level ) noexcept
+        {
+            return outcome == level;
+        }
+        
         // If we have won - what is the raw amount ?
         constexpr
         Amount WinningAmount( Level level ) const noexcept
         {
             if ( level == event )   return tx.amount;
-            return 0.;
+            return 0;
         }
         
         // What category do we belong to ?
@@ -124,6 +222,20 @@ namespace tp
         {
             return event;
         }
+        
+        // What the pool stores and scans on
+        constexpr
+        Key GetKey() const noexcept
+        {
+            return outcome;
+        }
+        
+        // No sides in a Mutex pool
+        constexpr
+        Side GetSide() const noexcept
+        {
+            return Side::Neither;
+        }
     };
 
     // Long Short Pool event
@@ -135,16 +247,17 @@ namespace tp
         using Amount = TX::Amount;
         using Price = int;
         using Level = int;
+        using Key = Price;
         
         Side        side{};     // Long or Short ?
         Price       price{};    // What price level ?
         Tx          tx;         // Associated tx
         
         double prima_facie_payoff{};                // Payoff / Odds before reweighting
-        double prima_facie_payout{};                // Absolute $ / ETH payout
-        double inverse_distance_to_the_pin{};       // Inverse distance to the pin
+        Amount prima_facie_payout{};                // Absolute $ / ETH payout
+        double inverse_distance_to_the_pin{};       // Inverse distance to the pin - the settlement weight / InverseDistanceOne
         double inverse_distance_to_pin_normalised;  // After normalisation
-        double adjusted_amount{};                   // Adjusted amount
+        Amount adjusted_amount{};                   // Adjusted amount
         
         LongShortEvent()=default;
         LongShortEvent( Side s, Price p ) : side{s}, price{p} {};
@@ -158,6 +271,13 @@ namespace tp
         // Ignore the side in the closing event - just look at the closing price
         constexpr
         bool IsWinner( Level level ) const noexcept
+        {
+            return Wins( side, price, level );
+        }
+        
+        // Column friendly version - the pool scans with this without building the event
+        static constexpr
+        bool Wins( Side side, Price price, Level level ) noexcept
         {
             if ( side == Side::Long )
             {
@@ -182,7 +302,7 @@ namespace tp
             {
                 if ( level < price )    return tx.amount;
             }
-            return 0.;
+            return 0;
         }
         
         // We need this to reweight the winners pool
@@ -191,15 +311,24 @@ namespace tp
         {
             if ( side == Side::Long )
             {
-                if ( closing_price > price )    return 1./(double)(closing_price - price);
+                if ( closing_price > price )    return 1./( (double)closing_price - price );
             }
             if ( side == Side::Short )
             {
-                if ( closing_price < price )    return 1./(double)(price - closing_price);
+                if ( closing_price < price )    return 1./( (double)price - closing_price );
             }
             return 1.;
         }
         
+        // Fixed point version we settle with - 0 for a loser. The distance is taken in 64 bits, two far apart
+        // prices don't fit in 32
+        static constexpr
+        std::int64_t InverseDistanceWeight( Side side, Price price, Level closing_price ) noexcept
+        {
+            std::int64_t distance = ( side == Side::Long ) ? (std::int64_t)closing_price - price : ( side == Side::Short ) ? (std::int64_t)price - closing_price : 0;
+            return distance > 0 ? InverseDistanceOne / distance : 0;
+        }
+        
         constexpr
         std::string Category() const noexcept
         {
@@ -213,285 +342,3410 @@ namespace tp
         {
             return price;
         }
+        
+        constexpr
+        Key GetKey() const noexcept
+        {
+            return price;
+        }
+        
+        constexpr
+        Side GetSide() const noexcept
+        {
+            return side;
+        }
     };
 
-    // Generic interface for both Mutex and LongShort Pools
-    struct PoolInterface
+    // One column of the risk store - its own vector, or a view of a mapped snapshot file until we first append to it
+    // Appending copies the mapped column out once. Copies of the column always own their storage
+    template <typename T>
+    struct Column
     {
-        virtual std::string PoolManagerAccount() const = 0;                     // Account name, crypto address
-        virtual std::string PoolAccount() const = 0;                            // Ditto
-        virtual std::map< std::string, double > CategoryMap() const = 0;
+        std::vector<T>  owned;
+        T*              first{};    // owned.data() or the mapped column
+        std::size_t     count{};
+        
+        Column() = default;
+        Column( Column&& ) = default;               // Moving a vector keeps its buffer so first stays good
+        Column& operator=( Column&& ) = default;
+        
+        Column( const Column& other ) : owned( other.begin(), other.end() ), first{ owned.data() }, count{ owned.size() } {}
+        
+        Column& operator=( const Column& other )
+        {
+            if ( this != &other )   *this = Column( other );
+            return *this;
+        }
+        
+        // View n mapped values - must outlive the column, RiskStore keeps the mapping alive
+        void View( T* values, std::size_t n )
+        {
+            owned = {};
+            first = values;
+            count = n;
+        }
+        
+        void reserve( std::size_t n )
+        {
+            if ( first != owned.data() )    owned.assign( first, first + count );
+            owned.reserve( n );
+            first = owned.data();
+        }
+        
+        void push_back( const T& value )
+        {
+            if ( first != owned.data() )    owned.assign( first, first + count );
+            owned.push_back( value );
+            first = owned.data();
+            count = owned.size();
+        }
+        
+        T& operator[]( std::size_t i )              { return first[i]; }
+        const T& operator[]( std::size_t i ) const  { return first[i]; }
+        T* data()                                   { return first; }
+        const T* data() const                       { return first; }
+        const T* begin() const                      { return first; }
+        const T* end() const                        { return first + count; }
+        std::size_t size() const noexcept           { return count; }
     };
 
-    // Use CRTP - static polymorphism
-    // https://en.wikipedia.org/wiki/Curiously_recurring_template_pattern
-    // D = Derived Implementation
-    template <typename D, typename EVENT>
-    struct Pool : PoolInterface
+    // Columnar store of the risks - the pool's tx counter hands out TxIds densely so they index the columns
+    // We only keep what we need to settle, the settlement output lives in the winners
+    template <typename EVENT>
+    struct RiskStore
     {
-        using Self      = Pool<D, EVENT>;
-        using Risk      = EVENT;
         using Event     = EVENT;
         using Amount    = EVENT::Amount;
-        using Level     = EVENT::Level;
-        using Tx        = EVENT::Tx;
+        using Key       = EVENT::Key;
         using TxId      = EVENT::TxId;
+        using AccountId = EVENT::Tx::AccountId;
         
-        TxId                    tx{};           // TxId counter
-        double                  fees{0.03};     // Pool fees - set to default 3%
-        std::map< TxId, Risk >  risks;          // List of risks keyed on tx_id
+        Column<Amount>          amount;     // Amount of capital at risk
+        Column<Side>            side;       // Long or Short - Neither for a Mutex event
+        Column<Key>             level;      // Price or interned event
+        Column<AccountId>       account;    // Client account
+        Column<std::uint8_t>    live;       // Zero once cancelled
+        std::shared_ptr<void>   mapping;    // Snapshot file the columns view, if any
         
-        // Return the transaction id - this mutates the pool
-        TxId MakeRisk( const Event& event, Amount amount, const std::string& who )
+        std::size_t size() const noexcept
         {
-            Event risk{ event };
-            risk.tx.id = tx;
-            risk.tx.amount = amount;
-            risk.tx.client_account = who;
-            risk.tx.pool_account = PoolAccount();
-            risks[tx++]  = risk;
-            return risk.tx.id;
+            return amount.size();
         }
         
-        // Note that this mutates the pool - we make a copy for the const version
-        // Level is the outcome that we want to know about
-        auto ProFormaReturnHelper( const Event& event, Amount amount, Level level )
+        void Add( Side s, Key key, Amount a, AccountId who )
         {
-            // Put the hypothetical risk into pool
-            auto tx_id = MakeRisk( event, amount, "Hypothetical" );
-            auto winning_risks = static_cast<D*>(this)->MakeWinningRisks( level );
-            try {
-                return winning_risks.at( tx_id );            // We won
-            } catch (...) {
-                return Risk{};                              // Its a bust
-            }
+            amount.push_back( a );
+            side.push_back( s );
+            level.push_back( key );
+            account.push_back( who );
+            live.push_back( 1 );
         }
         
-        auto ProFormaReturn( const Event& event, Amount amount, Level level ) const
+        void reserve( std::size_t n )
         {
-            // Copy the pool
-            Self pool{*this};
-            return pool.ProFormaReturnHelper( event, amount, level );
+            amount.reserve( n );
+            side.reserve( n );
+            level.reserve( n );
+            account.reserve( n );
+            live.reserve( n );
         }
+    };
+
+    // Fenwick tree (binary indexed tree) over compressed levels - L is the number of distinct levels
+    // Add and the prefix/suffix sums are O(log L), a level we haven't seen before costs an O(L) rebuild
+    template <typename KEY, typename VALUE>
+    struct FenwickIndex
+    {
+        using Value = VALUE;
         
-        // Set of unique end points
-        std::set<Level> MakeLevelSet() const
-        {
-            std::set<Level> levels;
-          
-            for (const auto& [tx,risk] : risks )    levels.insert( risk.GetLevel() );
+        std::vector<KEY>    keys;       // Sorted distinct levels - position is the compressed level
+        std::vector<VALUE>  values;     // Raw value per level, so we can rebuild
+        std::vector<VALUE>  tree;       // 1 based Fenwick tree over values
         
-            // If dealing with numbers add one tick under/over
-            if constexpr ( std::is_arithmetic_v<Level> )
+        // Add to a level, a negative value cancels
+        void Add( KEY key, VALUE value )
+        {
+            auto it = std::lower_bound( keys.begin(), keys.end(), key );
+            std::size_t i = it - keys.begin();
+            
+            if ( it == keys.end() || *it != key )
             {
-                auto min = *levels.begin();
-                auto max = *levels.rbegin();
-                
-                levels.insert(min-1);   // One tick under
-                levels.insert(max+1);   // One tick over
+                keys.insert( it, key );
+                values.insert( values.begin() + i, value );
+                Rebuild();
+                return;
             }
             
-            return levels;
+            values[i] += value;
+            for ( std::size_t j = i + 1; j < tree.size(); j += j & -j )   tree[j] += value;
         }
         
-        template <typename CALLABLE, typename ... ARGS >
-        void ForEachLevel( CALLABLE&& f, ARGS&&... args ) const
+        // Add many at once, sorted by key - one O(L) merge and rebuild rather than one per new level
+        void Add( std::span< const std::pair<KEY, VALUE> > sorted )
         {
-            auto levels = MakeLevelSet();
-            for (auto l : levels ) f( l, std::forward<ARGS>(args)... );
+            std::vector<KEY> merged_keys;
+            std::vector<VALUE> merged_values;
+            merged_keys.reserve( keys.size() + sorted.size() );
+            merged_values.reserve( keys.size() + sorted.size() );
+            
+            std::size_t i = 0;
+            for (const auto& [key,value] : sorted )
+            {
+                for ( ; i < keys.size() && keys[i] < key; ++i )
+                {
+                    merged_keys.push_back( keys[i] );
+                    merged_values.push_back( values[i] );
+                }
+                if ( !merged_keys.empty() && merged_keys.back() == key )    merged_values.back() += value;
+                else if ( i < keys.size() && keys[i] == key )
+                {
+                    merged_keys.push_back( key );
+                    merged_values.push_back( values[i++] + value );
+                }
+                else
+                {
+                    merged_keys.push_back( key );
+                    merged_values.push_back( value );
+                }
+            }
+            merged_keys.insert( merged_keys.end(), keys.begin() + i, keys.end() );
+            merged_values.insert( merged_values.end(), values.begin() + i, values.end() );
+            
+            keys.swap( merged_keys );
+            values.swap( merged_values );
+            Rebuild();
         }
         
-        Amount TotalPool() const
+        // Sum of the first n compressed levels
+        VALUE Prefix( std::size_t n ) const
         {
-            Amount result{};
-            for (auto& [tx,risk] : risks )    result += risk.tx.amount;
+            VALUE result{};
+            for ( std::size_t j = n; j > 0; j -= j & -j )   result += tree[j];
             return result;
         }
         
-        // What amounts have won at a given closing price/event ?
-        Amount TotalWinningAmount( Level level ) const
+        // Sum over the levels strictly under / over the key
+        VALUE SumBelow( KEY key ) const
         {
-            Amount  result{};
-            for (auto& [tx,risk] : risks )    result += risk.WinningAmount( level );
-            return result;
+            return Prefix( std::lower_bound( keys.begin(), keys.end(), key ) - keys.begin() );
         }
         
-        // What is the total winning amount for each price level - note that we mutuate here to get the unique price set
-        Amount PoolWinningAmount() const
+        VALUE SumAbove( KEY key ) const
         {
-            Amount result{};
-            ForEachLevel( [&]( auto level ){ result += TotalWinningAmount( level ); } );
-            return result;
+            return Prefix( keys.size() ) - Prefix( std::upper_bound( keys.begin(), keys.end(), key ) - keys.begin() );
         }
         
-        std::size_t CountWinningRisks( Level level ) const
+        // O(L) bottom up build
+        void Rebuild()
         {
-            std::size_t n{0};
-            for (auto& [tx,risk] : risks )    if ( risk.IsWinning( level ) )   ++n;
-            return n;
+            tree.assign( values.size() + 1, VALUE{} );
+            for ( std::size_t j = 1; j < tree.size(); ++j )
+            {
+                tree[j] += values[j-1];
+                auto parent = j + ( j & -j );
+                if ( parent < tree.size() )     tree[parent] += tree[j];
+            }
+        }
+    };
+
+    // Call f( begin, end ) on contiguous chunks of [0, n) - one chunk per hardware thread, this thread takes the first
+    // Chunks are at least grain long so small jobs don't pay for threads they don't need
+    template <typename CALLABLE>
+    void ParallelFor( std::size_t n, CALLABLE&& f, std::size_t grain = 16 )
+    {
+        std::size_t threads = std::min<std::size_t>( std::max( 1u, std::thread::hardware_concurrency() ), ( n + grain - 1 ) / grain );
+        if ( threads <= 1 )
+        {
+            f( std::size_t{0}, n );
+            return;
         }
         
-        Amount Fees() const
+        std::size_t chunk = ( n + threads - 1 ) / threads;
+        std::vector<std::thread> workers;
+        for ( std::size_t begin = chunk; begin < n; begin += chunk )
+            workers.emplace_back( [&f, begin, end = std::min( n, begin + chunk )]{ f( begin, end ); } );
+        f( std::size_t{0}, chunk );
+        for (auto& worker : workers )   worker.join();
+    }
+    
+    // What settlement needs to know about the risks - adds up over any split of them
+    struct SettlementTotals
+    {
+        std::int64_t pool{};        // Live amount at risk
+        std::int64_t win{};         // Live winning amount
+        std::int64_t weight{};      // Settlement weights of the winners
+        
+        SettlementTotals& operator+=( const SettlementTotals& other )
+        {
+            pool += other.pool;
+            win += other.win;
+            weight += other.weight;
+            return *this;
+        }
+    };
+    
+    // What a settlement reports besides the winners
+    enum class ReportField : std::uint8_t { Winner, ClosingPrice, PrimaFaciePayout, Fees, PoolValue, TotalPayout, Dust };
+    
+    inline
+    const char* ReportFieldName( ReportField field )
+    {
+        switch ( field )
         {
-            return TotalPool()*fees;
+            case ReportField::Winner :              return "Winner";
+            case ReportField::ClosingPrice :        return "Closing price";
+            case ReportField::PrimaFaciePayout :    return "Total prima facie payout";
+            case ReportField::Fees :                return "Fees";
+            case ReportField::PoolValue :           return "Pool value";
+            case ReportField::TotalPayout :         return "Total payout";
+            case ReportField::Dust :                return "Dust";
         }
+        return "Error";
+    }
+    
+    // Where settlement reports go - settlement itself does no I/O
+    // This one drops everything so quotes never format a thing, derive from it to keep the reports
+    template <typename RISK>
+    struct ReportSink
+    {
+        using TxId = RISK::TxId;
         
-        virtual std::string PoolManagerAccount() const override 
+        virtual ~ReportSink() = default;
+        virtual void Winners( const std::map< TxId, RISK >& ) {}
+        virtual void Total( ReportField, std::int64_t ) {}
+    };
+    
+    // Formats the reports as text into a buffer - nothing is written until Flush()
+    template <typename RISK>
+    struct TextReportSink : ReportSink<RISK>
+    {
+        using TxId = RISK::TxId;
+        
+        std::ostringstream buffer;
+        
+        virtual void Winners( const std::map< TxId, RISK >& winning_risks ) override
         {
-            return "Pool_Manager_Address";
+            buffer << winning_risks << '\n';
         }
         
-        virtual std::string PoolAccount() const override
+        virtual void Total( ReportField field, std::int64_t value ) override
         {
-            return "Pool_Account_Address";
+            buffer << ReportFieldName( field ) << " : " << value << '\n';
         }
         
-        virtual std::map< std::string, double > CategoryMap() const override
+        void Flush( std::ostream& os )
         {
-            std::map< std::string, double > result;
-            for (auto& [tx,risk] : risks )    result[ risk.Category() ] += risk.tx.amount;
-            return result;
+            os << buffer.str() << std::flush;
+            buffer.str( {} );
         }
-          
-        std::map< Level, double > ProFormaPayoffCurve( const Event& event, Amount amount)
+    };
+    
+    // Fixed width binary records - a ReportField byte then int64s in host byte order
+    // Winner is followed by tx id, amount and payout, the totals by their value
+    template <typename RISK>
+    struct BinaryReportSink : ReportSink<RISK>
+    {
+        using TxId = RISK::TxId;
+        
+        std::vector<char> buffer;
+        
+        virtual void Winners( const std::map< TxId, RISK >& winning_risks ) override
         {
-            std::map< Level, double > result;
-            ForEachLevel(  [&]( auto level ){
-                auto b = ProFormaReturn( event, amount, level );
-                result[ level ] = b.payoff;
-            } ) ;
-            return result;
+            for (const auto& [tx_id,risk] : winning_risks )
+            {
+                Put( ReportField::Winner );
+                Put( std::int64_t{ tx_id } );
+                Put( std::int64_t{ risk.tx.amount } );
+                Put( std::int64_t{ risk.tx.payout } );
+            }
+        }
+        
+        virtual void Total( ReportField field, std::int64_t value ) override
+        {
+            Put( field );
+            Put( value );
+        }
+        
+        template <typename T>
+        void Put( T value )
+        {
+            buffer.insert( buffer.end(), (const char*)&value, (const char*)&value + sizeof( T ) );
         }
     };
 
-    // Now the specific implementation of a Mutex pool
-    struct MutexPool : Pool< MutexPool, MutexEvent<DefaultTX> >
+    // Append only binary journal of the risks - a pool with a journal writes every MakeRisk and CancelRisk to it and
+    // Pool::Recover replays it. Records are buffered and only made durable by Commit, so one fsync covers a whole
+    // batch of risks (group commit)
+    // The header is the magic, the kind of pool that wrote it (uint32) and the pool's tx when the journal was started
+    // (int64), so it only replays onto the pool it started from. Each record after it is a type byte, fixed width
+    // fields in host byte order, then a checksum (uint32, FNV-1a over the type and fields)
+    //      Name    table (uint8), id (int32), length (uint32), bytes - interned strings, ahead of the first risk using them
+    //      Risk    tx id (int32), side (int32), key (int32), account (int32), amount (int64)
+    //      Cancel  tx id (int32)
+    // Start() moves the writes and syncs onto a background writer thread - Commit then hands the buffer over and
+    // intake carries on while the writer makes it durable. The writer takes everything handed over since it last
+    // looked in one write followed by one sync, so a slow disk means bigger groups rather than a stalled pool
+    struct Journal
     {
-        using Super = Pool< MutexPool, MutexEvent<DefaultTX> >;
+        enum class Record : std::uint8_t { Name = 1, Risk, Cancel };
+        enum class Table : std::uint8_t { Accounts, Keys };
+        using Done = std::function<void( bool )>;      // Called with false if the write or sync failed
         
-        std::map< TxId, Risk > MakeWinningRisks( Level level ) const
+        static constexpr char Header[8] = { 'T', 'P', 'J', 'R', 'N', 'L', '0', '3' };
+        static constexpr std::size_t HeaderSize = sizeof( Header ) + sizeof( std::uint32_t ) + sizeof( std::int64_t );
+        static constexpr std::uint32_t ChecksumSeed = 2166136261u;
+        
+        // What Replay returns instead of a length when the journal can't be replayed - Open refuses them all and leaves
+        // the file alone, as every whole record in it may have been acknowledged
+        static constexpr std::size_t Unreadable = std::numeric_limits<std::size_t>::max();     // There is a file but it isn't our journal
+        static constexpr std::size_t Mismatch = Unreadable - 1;    // Ours, but a whole record doesn't fit the pool - the wrong base tx say
+        static constexpr std::size_t Corrupt = Unreadable - 2;     // A record is damaged and there is more journal after it
+        
+        int                 fd{-1};
+        std::vector<char>   buffer;
+        std::size_t         group_bytes{ std::size_t{1} << 20 };   // Write out, without syncing, once this much is buffered
+        std::size_t         names[2]{};                             // How much of each table we have journaled
+        
+        // Background writer - only touched under the mutex, except durable
+        std::mutex                  mutex;
+        std::condition_variable     wake;
+        std::vector<char>           pending;        // Handed over, not written yet
+        std::vector<Done>           waiting;        // Called in order once their commit is durable
+        std::uint64_t               commits{};      // Commits handed over
+        std::uint64_t               synced{};       // Commits the writer has picked up to sync
+        std::atomic<std::uint64_t>  durable{};      // Commits done with - on disk if ok
+        bool                        ok{ true };     // Every write and sync so far worked - once false it stays false
+        bool                        stop{};
+        std::thread                 writer;
+        
+        Journal() = default;
+        Journal( const Journal& ) = delete;
+        Journal& operator=( const Journal& ) = delete;
+        
+        ~Journal()
         {
-            std::map< TxId, Risk > winning_risks;
-            
-            // Can do these steps in parallel
-            Amount total_pool_value = TotalPool()*(1.-fees);
-            Amount total_win_value = TotalWinningAmount( level );
-       
-            //Checks
-            double total_payout{};
+            Close();
+        }
+        
+        // Appends to the file - length is where the whole records end, from Replay, anything after is the torn tail
+        // of the last write and gets cut off. 0 starts a fresh journal for the kind of pool, based on the pool's tx
+        // now. Unreadable, Mismatch and Corrupt leave the file alone and fail
+        // Pass the table sizes the journal already holds so we don't write their names again
+        bool Open( const char* path, std::uint32_t kind, std::size_t length = 0, std::size_t accounts = 0, std::size_t keys = 0, std::int64_t base = 0 )
+        {
+            if ( length >= Corrupt )    return false;
+            fd = ::open( path, O_WRONLY | O_CREAT | O_APPEND, 0644 );
+            if ( fd < 0 )   return false;
+            if ( length > 0 && ::ftruncate( fd, length ) != 0 )    return false;
             
-            // Iterate over all of the risks pick the winner - we don't mtate risks
-            for (const auto& [tx,risk] : risks ) {
-                if ( risk.IsWinner( level ) )
+            char header[ HeaderSize ];
+            std::memcpy( header, Header, sizeof( Header ) );
+            std::memcpy( header + sizeof( Header ), &kind, sizeof( kind ) );
+            std::memcpy( header + sizeof( Header ) + sizeof( kind ), &base, sizeof( base ) );
+            if ( length == 0 && ( ::ftruncate( fd, 0 ) != 0 || Write( header, HeaderSize ) != HeaderSize ) )   return false;
+            ok = true;
+            names[ (int)Table::Accounts ] = accounts;
+            names[ (int)Table::Keys ] = keys;
+            return true;
+        }
+        
+        // Commits, stops the writer if there is one and closes the file
+        bool Close()
+        {
+            if ( fd < 0 )   return true;
+            bool committed = Commit();
+            if ( writer.joinable() )
+            {
                 {
-                    Risk winning_risk{risk};
-                    
-                    winning_risk.pool_share = risk.tx.amount / total_pool_value;
-                    winning_risk.winnings_share = risk.tx.amount / total_win_value;
-                    winning_risk.payoff = ( total_pool_value / total_win_value );
-                    winning_risk.tx.payout = risk.tx.amount * winning_risk.payoff;
-                    winning_risks[tx]=winning_risk;
-                    
-                    // Checks
-                    total_payout += winning_risk.tx.payout;
+                    std::lock_guard lock( mutex );
+                    stop = true;
                 }
+                wake.notify_one();
+                writer.join();
+                stop = false;
             }
-            
-            assert( Close( total_payout + Fees() , TotalPool() ) );
-           
-            std::cout << winning_risks << std::endl;
-            std::cout << "Fees : " << Fees() << std::endl;
-            std::cout << "Pool value : " << TotalPool() << std::endl;
-            std::cout << "Total payout : " << total_payout << std::endl;
-     
-            return winning_risks;
+            ::close( fd );
+            fd = -1;
+            return committed;
         }
-    };
-
-    // Now the specific implementation of a LongShort pool
-    struct LongShortPool : Pool< LongShortPool, LongShortEvent<DefaultTX> >
-    {
-        using Super = Pool< LongShortPool, LongShortEvent<DefaultTX> >;
         
-        std::map< TxId, Risk > MakeWinningRisks( Level level ) const
+        // Start the background writer on an open journal
+        void Start()
         {
-            std::map< TxId, Risk > winning_risks; //.clear();
-            
-            // Can do these steps in parallel
-            Amount total_pool_value = TotalPool()*(1.-fees);
-            Amount total_win_value = TotalWinningAmount( level );
-       
-            double total_inverse_distance_to_pin{};
+            assert( fd >= 0 && !writer.joinable() );
+            writer = std::thread( [this]{ Writer(); } );
+        }
+        
+        // Make everything so far durable - waits for the writer if there is one
+        // False if anything since Open failed to reach the disk, not just this commit
+        bool Commit()
+        {
+            if ( !writer.joinable() )
+            {
+                if ( !Write() || !Sync() )  ok = false;
+                return ok;
+            }
             
-            //Checks
-            double total_prima_facie_payout{}, total_payout{};
+            std::uint64_t commit = Commit( {} );
+            for ( auto done = durable.load(); done < commit; done = durable.load() )    durable.wait( done );
+            std::lock_guard lock( mutex );
+            return ok;
+        }
+        
+        // Ditto without waiting - done( ok ) is called on the writer thread once everything so far is durable
+        // Returns the commit number, durable reaches it when it's on disk
+        // Without a writer we commit here and now and call done straight away
+        std::uint64_t Commit( Done done )
+        {
+            if ( !writer.joinable() )
+            {
+                bool committed = Commit();
+                durable.store( ++commits );
+                if ( done )     done( committed );
+                return commits;
+            }
             
-            // Iterate over all of the risks pick the winner - we don't mutate
-            for (const auto& [tx,risk] : risks ) {
-                if ( risk.IsWinner( level ) )
+            std::uint64_t commit;
+            {
+                std::lock_guard lock( mutex );
+                HandOver();
+                commit = ++commits;
+                if ( done )     waiting.push_back( std::move( done ) );
+            }
+            wake.notify_one();
+            return commit;
+        }
+        
+        // Hand the buffer to the OS, or the writer - not durable until Commit
+        bool Write()
+        {
+            if ( writer.joinable() )
+            {
                 {
-                    Risk winning_risk{risk};
-                    
-                    winning_risk.pool_share = risk.tx.amount / total_pool_value;
-                    winning_risk.winnings_share = risk.tx.amount / total_win_value;
-                    winning_risk.prima_facie_payoff = ( total_pool_value / total_win_value );
-                    winning_risk.prima_facie_payout = risk.tx.amount * winning_risk.prima_facie_payoff;
-                    
-                    // Adjust the amount in proportion to the distance to the pin
-                    winning_risk.inverse_distance_to_the_pin = risk.WinningInverseDistance( level );
-                    total_inverse_distance_to_pin += winning_risk.inverse_distance_to_the_pin;
-                    
-                    winning_risks[tx]=winning_risk;
-                    
-                    // Checks
-                    total_prima_facie_payout += winning_risk.prima_facie_payout;
+                    std::lock_guard lock( mutex );
+                    HandOver();
                 }
+                wake.notify_one();
+                return true;
             }
             
-            // Now iterate over the winners - we mutate the winners here
-            for ( auto& [tx, winning_risk] : winning_risks ) {
-                winning_risk.inverse_distance_to_pin_normalised = winning_risk.inverse_distance_to_the_pin / total_inverse_distance_to_pin;
-                winning_risk.adjusted_amount = winning_risk.inverse_distance_to_pin_normalised * total_win_value;     // Redistribute the winning pool based on the inverse distance
-                winning_risk.tx.payout = winning_risk.adjusted_amount * winning_risk.prima_facie_payoff;
-                winning_risk.payoff = winning_risk.tx.payout / winning_risk.tx.amount;
-                
-                // Check
-                total_payout += winning_risk.tx.payout;
+            // Only drop what made it out - the rest stays buffered, the next Write tries it again
+            std::size_t written = Write( buffer.data(), buffer.size() );
+            buffer.erase( buffer.begin(), buffer.begin() + written );
+            if ( !buffer.empty() )  ok = false;
+            return buffer.empty();
+        }
+        
+        // How much of it we wrote - all of it unless there was an error
+        std::size_t Write( const char* bytes, std::size_t size )
+        {
+            std::size_t done = 0;
+            while ( done < size )
+            {
+                auto n = ::write( fd, bytes + done, size - done );
+                if ( n < 0 && errno == EINTR )  continue;
+                if ( n < 0 )    break;
+                done += n;
             }
-            
-            assert( Close( total_prima_facie_payout + Fees() , TotalPool() ) );
-            assert( Close( total_prima_facie_payout, total_payout ) );
-            
-            std::cout << "Closing price : " << level << std::endl;
-            std::cout << winning_risks << std::endl;
-            std::cout << "Total prima facie payout : " << total_prima_facie_payout << std::endl;
-            std::cout << "Fees : " << Fees() << std::endl;
-            std::cout << "Pool value : " << TotalPool() << std::endl;
-            std::cout << "Total payout : " << total_payout << std::endl;
-            
-            return winning_risks;
+            return done;
         }
-    };
-};
-
-int main(int argc, const char * argv[]) {
-    
-    using namespace tp;
-    
-    MutexPool mutex_pool;
+        
+        bool Sync()
+        {
+#if defined(__APPLE__)
+            while ( ::fcntl( fd, F_FULLFSYNC ) == -1 )  if ( errno != EINTR )   return false;   // fsync doesn't flush the drive cache on macOS
+#else
+            while ( ::fdatasync( fd ) != 0 )            if ( errno != EINTR )   return false;
+#endif
+            return true;
+        }
+        
+        // Under the mutex - move the buffer onto the end of pending, swapping when we can so there is no copy
+        // and we get back the writer's last buffer, capacity and all
+        void HandOver()
+        {
+            if ( pending.empty() )  pending.swap( buffer );
+            else                    pending.insert( pending.end(), buffer.begin(), buffer.end() );
+            buffer.clear();
+        }
+        
+        // The writer thread - write out whatever has been handed over, then one sync for every commit in it
+        void Writer()
+        {
+            std::vector<char> bytes;
+            std::vector<Done> done;
+            std::unique_lock lock( mutex );
+            for (;;)
+            {
+                wake.wait( lock, [&]{ return stop || !pending.empty() || synced < commits; } );
+                if ( pending.empty() && synced == commits )     return;     // Stopped with nothing left
+                
+                bytes.swap( pending );
+                done.swap( waiting );
+                std::uint64_t commit = commits;
+                bool sync = synced < commit;
+                synced = commit;
+                lock.unlock();
+                
+                bool written = Write( bytes.data(), bytes.size() ) == bytes.size() && ( !sync || Sync() );
+                bytes.clear();
+                
+                lock.lock();
+                ok = ok && written;
+                if ( pending.empty() )  pending.swap( bytes );      // Recycle the buffer
+                if ( !sync )    continue;
+                
+                bool durable_ok = ok;
+                lock.unlock();
+                durable.store( commit );
+                durable.notify_all();
+                for (auto& f : done )   f( durable_ok );
+                done.clear();
+                lock.lock();
+            }
+        }
+        
+        void Risk( std::int32_t tx_id, Side side, std::int32_t key, std::int32_t account, std::int64_t amount,
+                   const InternTable& accounts, const InternTable* keys )
+        {
+            Names( Table::Accounts, accounts );
+            if ( keys )     Names( Table::Keys, *keys );
+            std::size_t start = buffer.size();
+            Put( Record::Risk );
+            Put( tx_id );
+            Put( side );
+            Put( key );
+            Put( account );
+            Put( amount );
+            Seal( start );
+            if ( buffer.size() >= group_bytes )     Write();    // A failure sticks in ok for Commit to report
+        }
+        
+        void Cancel( std::int32_t tx_id )
+        {
+            std::size_t start = buffer.size();
+            Put( Record::Cancel );
+            Put( tx_id );
+            Seal( start );
+        }
+        
+        // Whatever the table has interned since we last looked
+        void Names( Table table, const InternTable& strings )
+        {
+            for ( auto& n = names[ (int)table ]; n < strings.names.size(); ++n )
+            {
+                const auto& name = strings.names[n];
+                std::size_t start = buffer.size();
+                Put( Record::Name );
+                Put( table );
+                Put( (std::int32_t)n );
+                Put( (std::uint32_t)name.size() );
+                buffer.insert( buffer.end(), name.begin(), name.end() );
+                Seal( start );
+            }
+        }
+        
+        // Checksum the record that starts at start
+        void Seal( std::size_t start )
+        {
+            Put( Checksum( ChecksumSeed, buffer.data() + start, buffer.size() - start ) );
+        }
+        
+        // FNV-1a - enough to tell a torn or damaged record from one we wrote
+        static std::uint32_t Checksum( std::uint32_t hash, const void* bytes, std::size_t size )
+        {
+            for ( std::size_t i = 0; i < size; ++i )    hash = ( hash ^ static_cast<const unsigned char*>( bytes )[i] ) * 16777619u;
+            return hash;
+        }
+        
+        template <typename T>
+        void Put( T value )
+        {
+            buffer.insert( buffer.end(), (const char*)&value, (const char*)&value + sizeof( T ) );
+        }
+        
+        // Call on_name( table, id, name ), on_risk( tx_id, side, key, account, amount ) and on_cancel( tx_id ) for each
+        // record in order - each returns false if the record doesn't fit the pool
+        // Returns where the last whole record ends - 0 if there is no journal, or an empty one. Only the end of the file
+        // can be torn: a short record, or a bad one with nothing but zeros after it. Unreadable if the file isn't a
+        // journal the kind of pool wrote, Mismatch if it was started on another base tx or a whole record doesn't
+        // fit, Corrupt if a bad record has more journal after it - the callbacks may have run for the records before
+        template <typename NAME, typename RISK, typename CANCEL>
+        static std::size_t Replay( const char* path, std::uint32_t kind, std::int64_t base, NAME&& on_name, RISK&& on_risk, CANCEL&& on_cancel )
+        {
+            std::ifstream in( path, std::ios::binary | std::ios::ate );
+            if ( !in )  return 0;
+            std::size_t size = in.tellg();
+            in.seekg( 0 );
+            
+            // Empty, or torn while Open wrote the header - nothing to lose, start afresh
+            char header[ HeaderSize ];
+            if ( size < HeaderSize && in.read( header, size ) && std::memcmp( header, Header, std::min( size, sizeof( Header ) ) ) == 0 )
+                return 0;
+            in.clear();
+            in.seekg( 0 );
+            
+            std::uint32_t written_by;
+            std::int64_t started;
+            if ( !in.read( header, HeaderSize ) || std::memcmp( header, Header, sizeof( Header ) ) != 0 )  return Unreadable;
+            std::memcpy( &written_by, header + sizeof( Header ), sizeof( written_by ) );
+            std::memcpy( &started, header + sizeof( Header ) + sizeof( written_by ), sizeof( started ) );
+            if ( written_by != kind )   return Unreadable;
+            if ( started != base )      return Mismatch;
+            
+            // A crash can leave the file longer than what reached it, zero filled
+            auto zeros_from = [&]( std::size_t from ) {
+                in.clear();
+                in.seekg( from );
+                char chunk[4096];
+                while ( in.read( chunk, sizeof( chunk ) ) || in.gcount() > 0 )
+                    if ( std::any_of( chunk, chunk + in.gcount(), []( char c ) { return c != 0; } ) )   return false;
+                return true;
+            };
+            
+            std::uint32_t hash;
+            auto get = [&]( void* value, std::size_t bytes ) {
+                if ( !in.read( (char*)value, bytes ) )  return false;
+                hash = Checksum( hash, value, bytes );
+                return true;
+            };
+            auto field = [&]( auto& value ) { return get( &value, sizeof( value ) ); };
+            
+            std::size_t length = HeaderSize;
+            for (;;)
+            {
+                Record record;
+                hash = ChecksumSeed;
+                if ( !field( record ) )     break;
+                
+                Table table{};
+                std::int32_t id{}, tx_id{}, key{}, account{};
+                std::uint32_t bytes{};
+                std::string name;
+                Side side{};
+                std::int64_t amount{};
+                bool whole;
+                if ( record == Record::Name )
+                {
+                    whole = field( table ) && field( id ) && field( bytes );
+                    if ( whole && bytes > size - length )   return zeros_from( length ) ? length : Corrupt;    // Not more than the file holds
+                    name.resize( bytes );
+                    whole = whole && get( name.data(), bytes );
+                }
+                else if ( record == Record::Risk )
+                    whole = field( tx_id ) && field( side ) && field( key ) && field( account ) && field( amount );
+                else if ( record == Record::Cancel )
+                    whole = field( tx_id );
+                else    return zeros_from( length ) ? length : Corrupt;
+                
+                std::uint32_t sealed, computed = hash;
+                if ( !whole || !field( sealed ) )   break;      // Torn - the file ends inside the record
+                std::size_t end = in.tellg();
+                if ( sealed != computed )   return end == size || zeros_from( length ) ? length : Corrupt;
+                
+                bool fits = ( record == Record::Name ) ? on_name( table, id, name )
+                          : ( record == Record::Risk ) ? on_risk( tx_id, side, key, account, amount )
+                          : on_cancel( tx_id );
+                if ( !fits )    return Mismatch;
+                length = end;
+            }
+            return length;
+        }
+    };
+    
+    // The journal a pool writes to - a copy of the pool starts without one and assigning a pool keeps its own, so
+    // a scratch copy can't write its risks, with TxIds the original will use too, into the original's journal
+    struct JournalLink
+    {
+        Journal* journal{};
+        
+        JournalLink() = default;
+        JournalLink( const JournalLink& ) {}
+        JournalLink& operator=( const JournalLink& ) { return *this; }
+        JournalLink& operator=( Journal* attach ) { journal = attach; return *this; }
+        
+        operator Journal*() const       { return journal; }
+        Journal* operator->() const     { return journal; }
+    };
+
+    // Fixed layout snapshot of a pool we can map and serve from straight away - no MakeRisk replay, no parsing
+    // The header is followed by sections, each a flat array starting on a cache line:
+    //      Header  magic, version, pool kind, tx, fees, total stake, paid out, then offset, count and element size per section
+    //      Section count elements of the given size - strings are two sections, uint64 offsets ( count + 1 ) then the bytes
+    // Each pool writes and maps its sections in the same fixed order - change the order, bump the Version
+    // The file is native endian, we read it on the machine that wrote it
+    // Settlement payout batches use the same layout, see Pool::ExportPayouts - paid out is only set in those
+    struct SnapshotFile
+    {
+        static constexpr char           Magic[8] = { 'T', 'P', 'S', 'N', 'A', 'P', '0', '1' };
+        static constexpr std::uint32_t  Version = 3;
+        static constexpr std::uint32_t  Payouts = 100;      // Kind for a payout batch - the pools are 1, 2 ...
+        static constexpr std::size_t    MaxSections = 32;
+        static constexpr std::size_t    Align = 64;
+        static constexpr std::size_t    PageAlign = 4096;   // Sections we Place - mmap offsets must be page aligned
+        
+        struct Section
+        {
+            std::uint64_t   offset{};
+            std::uint64_t   count{};
+            std::uint64_t   size{};     // Bytes per element
+        };
+        
+        struct Header
+        {
+            char            magic[8]{};
+            std::uint32_t   version{};
+            std::uint32_t   kind{};         // Which pool wrote it
+            std::int64_t    tx{};
+            std::int64_t    fees{};         // Basis points in a pool snapshot, the fees taken in payouts
+            std::int64_t    total_stake{};
+            std::int64_t    paid_out{};     // Payouts - what the payout column adds up to, 0 in a pool snapshot
+            std::int64_t    dust{};         // Ditto - the pool value left after the payouts, all of it if nobody won
+            std::uint64_t   sections{};
+            Section         section[ MaxSections ];
+        };
+        
+        Header                  header;
+        int                     fd{-1};     // Writing
+        std::string             temp;       // Ditto - path.tmp, until Finish renames it over path
+        std::uint64_t           length{};   // Ditto - where the next section goes
+        std::vector< std::pair<void*, std::size_t> >   placed;     // Ditto - sections mapped for the caller to fill
+        std::shared_ptr<void>   mapping;    // Reading - unmapped when the last pool viewing it lets go
+        std::size_t             next{};     // Ditto - the next section to hand out
+        bool                    bad{};      // Ditto - a section was missing or didn't fit what we asked for
+        
+        SnapshotFile() = default;
+        SnapshotFile( const SnapshotFile& ) = delete;
+        SnapshotFile& operator=( const SnapshotFile& ) = delete;
+        
+        ~SnapshotFile()
+        {
+            Unmap();
+            
+            // Never Finished - don't leave the half written file behind
+            if ( fd >= 0 )
+            {
+                ::close( fd );
+                std::remove( temp.c_str() );
+            }
+        }
+        
+        // Start writing - Finish puts it in place of path, so a reader never sees half a snapshot
+        bool Create( const char* path, std::uint32_t kind )
+        {
+            temp = std::string( path ) + ".tmp";
+            fd = ::open( temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+            std::memcpy( header.magic, Magic, sizeof( Magic ) );
+            header.version = Version;
+            header.kind = kind;
+            length = sizeof( Header );
+            return fd >= 0;
+        }
+        
+        template <typename T>
+        bool Put( const T* values, std::size_t count )
+        {
+            static_assert( std::is_trivially_copyable_v<T> );
+            assert( header.sections < MaxSections );
+            length = ( length + Align - 1 ) / Align * Align;
+            header.section[ header.sections++ ] = { length, count, sizeof( T ) };
+            
+            std::size_t bytes = count * sizeof( T );
+            if ( !WriteAt( values, bytes, length ) )    return false;
+            length += bytes;
+            return true;
+        }
+        
+        // All of bytes at offset - pwrite can be cut short or interrupted by a signal
+        bool WriteAt( const void* bytes, std::size_t size, std::size_t offset )
+        {
+            for ( std::size_t done = 0; done < size; )
+            {
+                auto n = ::pwrite( fd, (const char*)bytes + done, size - done, offset + done );
+                if ( n < 0 && errno == EINTR )  continue;
+                if ( n < 0 )    return false;
+                done += n;
+            }
+            return true;
+        }
+        
+        // A new section of count elements mapped straight onto the file, for the caller to fill in place rather than
+        // copy in - fill it before Finish. Empty if it couldn't be mapped
+        template <typename T>
+        std::span<T> Place( std::size_t count )
+        {
+            static_assert( std::is_trivially_copyable_v<T> );
+            assert( header.sections < MaxSections );
+            length = ( length + PageAlign - 1 ) / PageAlign * PageAlign;
+            header.section[ header.sections++ ] = { length, count, sizeof( T ) };
+            
+            std::size_t bytes = count * sizeof( T );
+            if ( bytes == 0 )   return {};
+            void* base = ::ftruncate( fd, length + bytes ) == 0 ? ::mmap( nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, length ) : MAP_FAILED;
+            if ( base == MAP_FAILED )   return {};
+            placed.emplace_back( base, bytes );
+            length += bytes;
+            return { (T*)base, count };
+        }
+        
+        // Flush the placed sections back to the file - false if any of them didn't make it
+        bool Unmap()
+        {
+            bool ok = true;
+            for (auto [base,bytes] : placed )
+            {
+                ok = ::msync( base, bytes, MS_SYNC ) == 0 && ok;
+                ::munmap( base, bytes );
+            }
+            placed.clear();
+            return ok;
+        }
+        
+        bool Put( const std::vector<std::string>& strings )
+        {
+            std::vector<std::uint64_t> offsets{ 0 };
+            std::string bytes;
+            for (const auto& string : strings )
+            {
+                bytes += string;
+                offsets.push_back( bytes.size() );
+            }
+            return Put( offsets.data(), offsets.size() ) && Put( bytes.data(), bytes.size() );
+        }
+        
+        // Header last, then sync and rename over path - on failure the temporary is removed and path left as it was
+        bool Finish( const char* path )
+        {
+            bool ok = Unmap();
+            ok = ok && ::ftruncate( fd, length ) == 0 && WriteAt( &header, sizeof( Header ), 0 );
+#if defined(__APPLE__)
+            while ( ok && ::fcntl( fd, F_FULLFSYNC ) == -1 )    ok = errno == EINTR;
+#else
+            while ( ok && ::fdatasync( fd ) != 0 )              ok = errno == EINTR;
+#endif
+            ::close( fd );
+            fd = -1;
+            ok = ok && std::rename( temp.c_str(), path ) == 0;
+            if ( !ok )  std::remove( temp.c_str() );
+            return ok;
+        }
+        
+        // Map a snapshot the kind of pool we are - copy on write, so cancels on the pool never reach the file
+        bool Map( const char* path, std::uint32_t kind )
+        {
+            int file = ::open( path, O_RDONLY );
+            if ( file < 0 )     return false;
+            
+            struct stat status;
+            std::size_t size = ::fstat( file, &status ) == 0 ? status.st_size : 0;
+            void* base = size >= sizeof( Header ) ? ::mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0 ) : MAP_FAILED;
+            ::close( file );
+            if ( base == MAP_FAILED )   return false;
+            mapping = std::shared_ptr<void>( base, [size]( void* p ){ ::munmap( p, size ); } );
+            
+            std::memcpy( &header, base, sizeof( Header ) );
+            if ( std::memcmp( header.magic, Magic, sizeof( Magic ) ) != 0 || header.version != Version || header.kind != kind )   return false;
+            if ( header.sections > MaxSections )    return false;
+            for ( std::size_t i = 0; i < header.sections; ++i )
+            {
+                const auto& section = header.section[i];
+                if ( section.offset % Align != 0 || section.offset > size || section.size == 0
+                    || section.count > ( size - section.offset ) / section.size )   return false;
+            }
+            return true;
+        }
+        
+        // The next section, in place in the mapping - empty, and the file bad, if it isn't there or isn't a T
+        template <typename T>
+        std::span<T> Get()
+        {
+            if ( bad || next >= header.sections || header.section[ next ].size != sizeof( T ) )
+            {
+                bad = true;
+                return {};
+            }
+            const auto& section = header.section[ next++ ];
+            return { (T*)( (char*)mapping.get() + section.offset ), section.count };
+        }
+        
+        // Ditto, and bad unless it has count elements - for columns that go with something we've already read
+        template <typename T>
+        std::span<T> Get( std::size_t count )
+        {
+            auto values = Get<T>();
+            if ( values.size() == count )   return values;
+            bad = true;
+            return {};
+        }
+        
+        // The offsets have to run up from 0 inside the bytes, or we would read past them
+        std::vector<std::string> GetStrings()
+        {
+            auto offsets = Get<std::uint64_t>();
+            auto bytes = Get<char>();
+            if ( offsets.empty() || offsets[0] != 0 || !std::is_sorted( offsets.begin(), offsets.end() ) || offsets.back() > bytes.size() )
+            {
+                bad = true;
+                return {};
+            }
+            std::vector<std::string> strings;
+            for ( std::size_t i = 0; i + 1 < offsets.size(); ++i )
+                strings.emplace_back( bytes.data() + offsets[i], offsets[i+1] - offsets[i] );
+            return strings;
+        }
+    };
+
+    // Splits CSV text into lines of fields - no quoting, the exchange exports don't need it
+    // The delimiters are found 32 bytes at a time with AVX2 where we have it, the fields are views into the text
+    struct CsvScanner
+    {
+        static constexpr std::size_t MaxFields = 16;   // Any more are dropped
+        
+        // f( fields ) for every line, fields is a span of string_views - a trailing \r is trimmed off the last one
+        template <typename CALLABLE>
+        static void Lines( std::string_view text, CALLABLE&& f )
+        {
+            std::array< std::string_view, MaxFields > fields;
+            std::size_t n = 0, start = 0;
+            
+            auto field = [&]( std::size_t end ) {
+                if ( n < MaxFields )    fields[ n++ ] = text.substr( start, end - start );
+                start = end + 1;
+            };
+            auto line = [&]( std::size_t end ) {
+                field( end );
+                if ( auto& last = fields[ n - 1 ]; !last.empty() && last.back() == '\r' )    last.remove_suffix( 1 );
+                f( std::span< const std::string_view >( fields.data(), n ) );
+                n = 0;
+            };
+            
+            Delimiters( text, [&]( std::size_t i ) {
+                if ( text[i] == ',' )   field( i );
+                else                    line( i );
+            } );
+            if ( start < text.size() )  line( text.size() );   // No newline at the end
+        }
+        
+        // f( i ) for every comma and newline in order
+        template <typename CALLABLE>
+        static void Delimiters( std::string_view text, CALLABLE&& f )
+        {
+#if defined(__x86_64__) && ( defined(__GNUC__) || defined(__clang__) )
+            static const bool avx2 = __builtin_cpu_supports( "avx2" );
+            if ( avx2 )
+            {
+                DelimitersAVX2( text, f );
+                return;
+            }
+#endif
+            DelimitersScalar( text, 0, f );
+        }
+        
+        template <typename CALLABLE>
+        static void DelimitersScalar( std::string_view text, std::size_t i, CALLABLE& f )
+        {
+            for ( ; i < text.size(); ++i )
+                if ( text[i] == ',' || text[i] == '\n' )   f( i );
+        }
+        
+#if defined(__x86_64__)
+        // One bit per byte that is a delimiter, then walk the set bits
+        template <typename CALLABLE>
+        __attribute__((target("avx2")))
+        static void DelimitersAVX2( std::string_view text, CALLABLE& f )
+        {
+            const __m256i comma = _mm256_set1_epi8( ',' ), newline = _mm256_set1_epi8( '\n' );
+            std::size_t i = 0;
+            for ( ; i + 32 <= text.size(); i += 32 )
+            {
+                __m256i bytes = _mm256_loadu_si256( (const __m256i*)( text.data() + i ) );
+                auto mask = (std::uint32_t)_mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpeq_epi8( bytes, comma ), _mm256_cmpeq_epi8( bytes, newline ) ) );
+                for ( ; mask; mask &= mask - 1 )    f( i + std::countr_zero( mask ) );
+            }
+            DelimitersScalar( text, i, f );
+        }
+#endif
+        
+        // Whole field as an integer, false if there is anything else in it
+        template <typename T>
+        static bool Parse( std::string_view field, T& value )
+        {
+            auto [end, error] = std::from_chars( field.data(), field.data() + field.size(), value );
+            return error == std::errc{} && end == field.data() + field.size();
+        }
+    };
+
+    // Generic interface for both Mutex and LongShort Pools
+    struct PoolInterface
+    {
+        virtual ~PoolInterface() = default;
+        
+        virtual std::string PoolManagerAccount() const = 0;                     // Account name, crypto address
+        virtual std::string PoolAccount() const = 0;                            // Ditto
+        virtual std::map< std::string, double > CategoryMap() const = 0;
+    };
+
+    // Use CRTP - static polymorphism
+    // https://en.wikipedia.org/wiki/Curiously_recurring_template_pattern
+    // D = Derived Implementation
+    template <typename D, typename EVENT>
+    struct Pool : PoolInterface
+    {
+        using Self      = Pool<D, EVENT>;
+        using Risk      = EVENT;
+        using Event     = EVENT;
+        using Amount    = EVENT::Amount;
+        using Level     = EVENT::Level;
+        using Key       = EVENT::Key;
+        using Tx        = EVENT::Tx;
+        using TxId      = EVENT::TxId;
+        using AccountId = Tx::AccountId;
+        using Report    = ReportSink< EVENT >;
+        
+        static inline Report    NoReport;       // Default sink for settlement - drops the reports
+        static constexpr TxId   None = -1;      // What MakeRisks returns for a batch it won't take
+        
+        TxId                    tx{};           // TxId counter
+        std::int64_t            fee_bps{300};   // Pool fees in basis points - set to default 3%
+        RiskStore< Event >      risks;          // Columns of risks indexed on tx_id
+        
+        InternTable             accounts;               // Client account names - risks only carry the ids
+        AccountId               hypothetical_account{}; // Who the quotes are for
+        JournalLink             journal;                // Where MakeRisk and CancelRisk are journaled - none by default
+        
+        // The pool's own account isn't a client, so it isn't interned - PoolAccount() names it, and being virtual
+        // it can only be asked once we are constructed
+        Pool()
+        {
+            hypothetical_account = accounts.Intern( "Hypothetical" );
+        }
+        
+        // Running totals - kept up to date by MakeRisk so the accessors don't rescan the risks
+        Amount                          total_stake{};      // Sum of all the amounts at risk
+        std::map< std::string, Amount > category_stake;     // Amount at risk per category
+        std::map< Key, Amount >         level_stake;        // Amount at risk per level
+        
+        // Whether a stake can go on top of total - no negative amounts, and the sum has to fit in an Amount. Every other
+        // running total is part of total_stake, so if it fits none of them can overflow either
+        static bool Fits( Amount total, Amount amount )
+        {
+            Amount sum;
+            return amount >= 0 && !__builtin_add_overflow( total, amount, &sum );
+        }
+        
+        // Return the transaction id - this mutates the pool
+        // None, and the risk isn't made, if the stake doesn't Fit
+        TxId MakeRisk( const Event& event, Amount amount, const std::string& who )
+        {
+            return MakeRisk( event, amount, accounts.Intern( who ) );
+        }
+        
+        // Ditto for an account we have already interned - only the side and key go any further, no event is built
+        TxId MakeRisk( const Event& event, Amount amount, AccountId who )
+        {
+            if ( !Fits( total_stake, amount ) )     return None;
+            
+            auto pool = static_cast<D*>(this);
+            Side side = event.GetSide();
+            Key key = pool->InternKey( event );
+            TxId id = tx++;
+            risks.Add( side, key, amount, who );
+            Stake( side, key, amount, +1 );
+            if ( journal )  journal->Risk( id, side, key, who, amount, accounts, pool->KeyTable() );
+            return id;
+        }
+        
+        const std::string& AccountName( AccountId id ) const
+        {
+            return accounts.Name( id );
+        }
+        
+        // One row of a bulk load, with the key and account already interned - trivially copyable, so a packed
+        // binary export is just an array of these we can map and hand to MakeRisks
+        struct BulkRisk
+        {
+            Side        side{};
+            Key         key{};
+            Amount      amount{};
+            AccountId   account{};
+        };
+        
+        // Per side and key totals a bulk load adds up before touching the running totals
+        struct StakeGroup
+        {
+            Amount          amount{};
+            std::int64_t    count{};
+        };
+        using StakeGroups = std::unordered_map< std::uint64_t, StakeGroup >;
+        
+        // Many risks at once - the same pool as MakeRisk one at a time, in one pass with the columns reserved up front
+        // The running totals are added up per side and key as we go, so the maps and indices are touched once per
+        // distinct key rather than once per risk. Returns the first TxId, the rest follow on
+        // The rows come from outside, so all of them are checked first - if any has an account we haven't interned
+        // or a side and key the derived pool doesn't take, or the amounts don't Fit the pool, it is left alone and we return None
+        TxId MakeRisks( std::span<const BulkRisk> rows )
+        {
+            auto pool = static_cast<const D*>(this);
+            if ( rows.size() > std::size_t( std::numeric_limits<TxId>::max() - tx ) )  return None;
+            Amount total = total_stake;
+            for (const auto& row : rows )
+            {
+                if ( !Fits( total, row.amount ) || row.account < 0 || std::size_t( row.account ) >= accounts.names.size() || !pool->ValidRisk( row.side, row.key ) )
+                    return None;
+                total += row.amount;
+            }
+            
+            TxId first = tx;
+            StakeGroups groups;
+            risks.reserve( tx + rows.size() );
+            for (const auto& row : rows )  AddBulkRisk( row, groups );
+            AddStakeGroups( groups );
+            return first;
+        }
+        
+        // Ditto straight from CSV text - side,level,amount,account per line, the amount in the smallest unit
+        // Lines the derived pool can't parse, or with an amount that doesn't Fit, are skipped, a header line included.
+        // Nothing is loaded if there are more lines than TxIds left. Returns how many risks we made
+        std::size_t LoadCsv( std::string_view text )
+        {
+            auto pool = static_cast<D*>(this);
+            TxId first = tx;
+            Amount total = total_stake;
+            StakeGroups groups;
+            std::size_t lines = std::count( text.begin(), text.end(), '\n' ) + 1;
+            if ( lines > std::size_t( std::numeric_limits<TxId>::max() - tx ) )    return 0;
+            risks.reserve( tx + lines );
+            
+            CsvScanner::Lines( text, [&]( std::span< const std::string_view > fields ) {
+                BulkRisk row;
+                if ( fields.size() < 4 || !CsvScanner::Parse( fields[2], row.amount ) || !Fits( total, row.amount )
+                    || !pool->ParseRisk( fields[0], fields[1], row.side, row.key ) )  return;
+                total += row.amount;
+                row.account = accounts.Intern( fields[3] );
+                AddBulkRisk( row, groups );
+            } );
+            AddStakeGroups( groups );
+            return tx - first;
+        }
+        
+        // Columns and journal for one bulk row - the running totals wait for AddStakeGroups
+        void AddBulkRisk( const BulkRisk& row, StakeGroups& groups )
+        {
+            static_assert( std::is_integral_v<Key> && sizeof( Key ) <= 4 );
+            risks.Add( row.side, row.key, row.amount, row.account );
+            if ( journal )  journal->Risk( tx, row.side, row.key, row.account, row.amount, accounts, static_cast<const D*>(this)->KeyTable() );
+            ++tx;
+            
+            auto& group = groups[ (std::uint64_t)(std::uint32_t)row.side << 32 | (std::uint32_t)row.key ];
+            group.amount += row.amount;
+            ++group.count;
+        }
+        
+        // Move the running totals by a bulk load's groups
+        void AddStakeGroups( const StakeGroups& groups )
+        {
+            std::vector< std::tuple< Side, Key, StakeGroup > > stakes;
+            for (const auto& [packed,group] : groups )
+            {
+                Side side = (Side)( packed >> 32 );
+                Key key = (Key)(std::uint32_t)packed;
+                
+                total_stake += group.amount;
+                static_cast<D*>(this)->StakeCategory( side, key, group.amount );
+                if ( ( level_stake[ key ] += group.amount ) == Amount{} )          level_stake.erase( key );
+                stakes.emplace_back( side, key, group );
+            }
+            
+            // Signed keys - sort them as themselves, not as the packed bits
+            std::sort( stakes.begin(), stakes.end(), []( const auto& a, const auto& b ){
+                return std::tie( std::get<0>( a ), std::get<1>( a ) ) < std::tie( std::get<0>( b ), std::get<1>( b ) );
+            } );
+            static_cast<D*>(this)->IndexStakes( stakes );
+        }
+        
+        // Parse the side and level of a CSV row into what we store - the derived pools know what their levels look like
+        bool ParseRisk( std::string_view, std::string_view, Side&, Key& ) { return false; }
+        
+        // Whether a side and key already in our form make a risk this pool can hold - for MakeRisks
+        bool ValidRisk( Side, Key ) const { return false; }
+        
+        // Take a risk back out of the pool - this mutates the pool
+        void CancelRisk( TxId id )
+        {
+            if ( id < 0 || id >= tx || !risks.live[id] )   return;
+            
+            Stake( risks.side[id], risks.level[id], risks.amount[id], -1 );
+            risks.live[id] = 0;
+            if ( journal )  journal->Cancel( id );
+        }
+        
+        // The risk as MakeRisk made it - an empty Risk if we never made it
+        Risk GetRisk( TxId id ) const
+        {
+            if ( id < 0 || id >= tx )   return Risk{};
+            
+            Risk risk = static_cast<const D*>(this)->MakeEvent( risks.side[id], risks.level[id] );
+            risk.tx.id = id;
+            risk.tx.amount = risks.amount[id];
+            risk.tx.client_account = risks.account[id];
+            return risk;
+        }
+        
+        // Call f( tx_id ) for every live risk that wins at the level - a straight scan down the columns
+        template <typename CALLABLE>
+        void ForEachWinner( const Level& level, CALLABLE&& f ) const
+        {
+            Key key = static_cast<const D*>(this)->ToKey( level );
+            for ( TxId id = 0; id < tx; ++id )
+                if ( risks.live[id] && Event::Wins( risks.side[id], risks.level[id], key ) )   f( id );
+        }
+        
+        // Hooks between the levels we are asked about and the keys we store - the same thing by default
+        Key InternKey( const Event& event )     { return event.GetKey(); }
+        Key ToKey( const Level& level ) const   { return level; }
+        Level ToLevel( Key key ) const          { return key; }
+        Risk MakeEvent( Side side, Key key ) const
+        {
+            return Risk{ side, key };
+        }
+        
+        // Interned strings behind the keys, if any - the journal records them
+        InternTable* KeyTable()                 { return nullptr; }
+        const InternTable* KeyTable() const     { return nullptr; }
+        
+        // Rebuild an empty pool from its journal, running totals and all - attach the journal after, with
+        // auto base = tx; auto length = Recover( path ); then
+        // journal.Open( path, D::PoolKind, length, accounts.names.size(), key table size, base )
+        // Separate statements - the base is the tx before Recover, the table sizes are read after it has interned the names
+        // The journal has to start from the tx the pool has now - 0 for an empty pool, a mapped snapshot's tx on top of one
+        // Every record is checked against the pool we have so far - a name has to be one we have or the next id of a table,
+        // a risk the next TxId with an account we know and a side and key we take, a cancel one of our risks
+        // Returns where the last whole record ends, or Journal::Unreadable, Mismatch or Corrupt, which Open refuses and
+        // which leave the pool part replayed - start again from an empty one
+        std::size_t Recover( const char* path )
+        {
+            auto pool = static_cast<D*>(this);
+            return Journal::Replay( path, D::PoolKind, tx,
+                [&]( Journal::Table table, InternTable::Id id, const std::string& name ) {
+                    auto* strings = ( table == Journal::Table::Accounts ) ? &accounts : ( table == Journal::Table::Keys ) ? pool->KeyTable() : nullptr;
+                    if ( !strings || id < 0 || std::size_t( id ) > strings->names.size() )   return false;
+                    return std::size_t( id ) < strings->names.size() ? strings->names[id] == name : strings->Intern( name ) == id;
+                },
+                [&]( TxId id, Side side, Key key, AccountId account, Amount amount ) {
+                    if ( id != tx || account < 0 || std::size_t( account ) >= accounts.names.size() || amount < 0 || !pool->ValidRisk( side, key ) )
+                        return false;
+                    return MakeRisk( pool->MakeEvent( side, key ), amount, account ) != None;
+                },
+                [&]( TxId id ) {
+                    if ( id < 0 || id >= tx )   return false;
+                    CancelRisk( id );
+                    return true;
+                } );
+        }
+        
+        // Write the whole pool - columns, interned strings and running totals - as a snapshot file MapSnapshotFile
+        // can serve from. Takes a consistent pool, so no MakeRisk while it runs
+        bool WriteSnapshotFile( const char* path ) const
+        {
+            SnapshotFile file;
+            if ( !file.Create( path, D::PoolKind ) )   return false;
+            
+            file.header.tx = tx;
+            file.header.fees = fee_bps;
+            file.header.total_stake = total_stake;
+            return static_cast<const D*>(this)->WriteSections( file ) && file.Finish( path );
+        }
+        
+        // Turn an empty pool into the one in the snapshot file - the risk columns are mapped, not copied, and only
+        // read once to check them. Only the strings and per level totals are copied out of the file
+        // Quotes and settlement work straight away, and MakeRisk carries on from the snapshot - the first one copies
+        // the mapped columns out. A journal started after the snapshot, based on its tx, can be Recovered on top of it
+        // False, with the pool left empty, if the sections don't hold together or a risk isn't one we could have made
+        bool MapSnapshotFile( const char* path )
+        {
+            SnapshotFile file;
+            if ( !file.Map( path, D::PoolKind ) || file.header.tx < 0 || file.header.tx > std::numeric_limits<TxId>::max() )
+                return false;
+            
+            tx = (TxId)file.header.tx;
+            fee_bps = file.header.fees;
+            total_stake = file.header.total_stake;
+            if ( static_cast<D*>(this)->MapSections( file ) && ValidColumns() )   return true;
+            
+            // Back to the empty pool we were, so nothing half mapped gets served - assigning keeps the journal
+            *static_cast<D*>(this) = D();
+            return false;
+        }
+        
+        // Every risk in the columns has an account we know, a side and key the pool takes and no negative amount
+        // One pass down the columns - cheap next to serving a risk that reads past the tables
+        bool ValidColumns() const
+        {
+            auto pool = static_cast<const D*>(this);
+            for ( TxId id = 0; id < tx; ++id )
+                if ( risks.amount[id] < 0 || risks.account[id] < 0 || std::size_t( risks.account[id] ) >= accounts.names.size()
+                    || risks.live[id] > 1 || !pool->ValidRisk( risks.side[id], risks.level[id] ) )     return false;
+            return true;
+        }
+        
+        // The derived pools add their own sections after ours
+        bool WriteSections( SnapshotFile& file ) const
+        {
+            std::vector<std::string> categories;
+            std::vector<Amount> category_amounts, level_amounts;
+            std::vector<Key> levels;
+            for (const auto& [category,amount] : category_stake )
+            {
+                categories.push_back( category );
+                category_amounts.push_back( amount );
+            }
+            for (const auto& [key,amount] : level_stake )
+            {
+                levels.push_back( key );
+                level_amounts.push_back( amount );
+            }
+            
+            return file.Put( risks.amount.data(), tx ) && file.Put( risks.side.data(), tx ) && file.Put( risks.level.data(), tx )
+                && file.Put( risks.account.data(), tx ) && file.Put( risks.live.data(), tx ) && file.Put( accounts.names )
+                && file.Put( categories ) && file.Put( category_amounts.data(), category_amounts.size() )
+                && file.Put( levels.data(), levels.size() ) && file.Put( level_amounts.data(), level_amounts.size() );
+        }
+        
+        // False if the file doesn't hold together - every column has tx risks, every total goes with a key
+        bool MapSections( SnapshotFile& file )
+        {
+            auto view = [&]( auto& column ) {
+                auto values = file.Get< std::remove_reference_t< decltype( column[0] ) > >( tx );
+                column.View( values.data(), values.size() );
+            };
+            view( risks.amount );
+            view( risks.side );
+            view( risks.level );
+            view( risks.account );
+            view( risks.live );
+            risks.mapping = file.mapping;
+            
+            accounts = {};
+            for (const auto& name : file.GetStrings() )     accounts.Intern( name );
+            hypothetical_account = accounts.Find( "Hypothetical" );
+            if ( hypothetical_account == InternTable::None )    return false;
+            
+            auto categories = file.GetStrings();
+            auto category_amounts = file.Get<Amount>( categories.size() );
+            category_stake.clear();
+            if ( file.bad )     return false;
+            for ( std::size_t i = 0; i < categories.size(); ++i )   category_stake.emplace_hint( category_stake.end(), categories[i], category_amounts[i] );
+            
+            auto levels = file.Get<Key>();
+            auto level_amounts = file.Get<Amount>( levels.size() );
+            level_stake.clear();
+            if ( file.bad )     return false;
+            for ( std::size_t i = 0; i < levels.size(); ++i )       level_stake.emplace_hint( level_stake.end(), levels[i], level_amounts[i] );
+            return true;
+        }
+        
+        // Move the running totals by the risk - sign is -1 when we cancel
+        void Stake( Side side, Key key, Amount amount, int sign )
+        {
+            auto pool = static_cast<D*>(this);
+            total_stake += sign * amount;
+            pool->StakeCategory( side, key, sign * amount );
+            if ( ( level_stake[ key ] += sign * amount ) == Amount{} )  level_stake.erase( key );
+            pool->IndexRisk( side, key, amount, sign );
+        }
+        
+        // Hook for the running total per category
+        void StakeCategory( Side side, Key key, Amount amount )
+        {
+            auto category = static_cast<const D*>(this)->MakeEvent( side, key ).Category();
+            if ( ( category_stake[ category ] += amount ) == Amount{} )    category_stake.erase( category );
+        }
+        
+        // Hook for the derived pool to maintain its own indices - nothing to do by default
+        void IndexRisk( Side, Key, Amount, int ) {}
+        
+        // Ditto for a bulk load - ( side, key, totals ) sorted by side then key
+        void IndexStakes( std::span< const std::tuple< Side, Key, StakeGroup > > ) {}
+        
+        // The result of settling at a level - only the totals, each tx's payout is worked out from them when asked for
+        // The derived pool gives every risk a weight at the level, 0 for a loser, and the winners share the pool
+        // value in proportion to their weights
+        // It reads the risks from the live pool, so leave the pool alone while you use it - a risk made since we
+        // settled is a bust, it isn't in the totals, but a cancel would pay out of totals that still hold its stake
+        struct Settlement
+        {
+            const D*        pool{};
+            Level           level{};
+            Key             key{};
+            Amount          fees{};
+            Amount          total_pool_value{};     // What is left to pay out after the fees
+            Amount          total_win_value{};
+            std::int64_t    total_weight{};
+            TxId            tx{};                   // Risks in the pool when we settled - the totals only have these
+            
+            // 0 for a tx that wasn't in the pool when we settled - its a bust
+            std::int64_t Weight( TxId id ) const
+            {
+                if ( id < 0 || id >= tx )   return 0;
+                return pool->risks.live[id] ? pool->SettlementWeight( id, key ) : 0;
+            }
+            
+            bool IsWinner( TxId id ) const
+            {
+                return Weight( id ) > 0;
+            }
+            
+            // O(1) - rounded down, the dust goes to the pool account
+            Amount Payout( TxId id ) const
+            {
+                return Payout( Weight( id ) );
+            }
+            
+            Amount Payout( std::int64_t weight ) const
+            {
+                return weight > 0 ? MulDiv( total_pool_value, weight, total_weight ) : 0;
+            }
+            
+            double Payoff( TxId id ) const
+            {
+                if ( id < 0 || id >= tx )   return 0.;
+                return Payout( id ) / (double)pool->risks.amount[id];
+            }
+            
+            // The risk with its settlement filled in as MakeWinningRisks has it - an empty Risk if its a bust
+            Risk GetRisk( TxId id ) const
+            {
+                std::int64_t weight = Weight( id );
+                return weight > 0 ? pool->MakeSettledRisk( *this, id, weight ) : Risk{};
+            }
+        };
+        
+        // Settle off the running totals - O(1) in the number of risks for a Mutex pool, O(L) in the prices for a LongShort
+        // Nothing is allocated, ask the result for the payouts you need
+        Settlement Settle( Level level ) const
+        {
+            assert( tx > 0 || total_stake == Amount{} );    // Settle the pool, a MakeSnapshot has no risks to pay out
+            auto pool = static_cast<const D*>(this);
+            Amount fees = Fees();
+            return { pool, level, pool->ToKey( level ), fees, TotalPool() - fees, pool->TotalWinningAmount( level ), pool->TotalWinningWeight( level ), tx };
+        }
+        
+        // Ditto from totals scanned off the columns
+        Settlement Settle( Level level, const SettlementTotals& totals ) const
+        {
+            assert( tx > 0 || total_stake == Amount{} );
+            auto pool = static_cast<const D*>(this);
+            Amount fees = Fees( totals.pool );
+            return { pool, level, pool->ToKey( level ), fees, totals.pool - fees, totals.win, totals.weight, tx };
+        }
+        
+        // Settlement totals over the risks [begin, end) straight off the columns - lets us split a pool into chunks
+        SettlementTotals ScanTotals( Level level, TxId begin, TxId end ) const
+        {
+            SettlementTotals totals;
+            Key key = static_cast<const D*>(this)->ToKey( level );
+            for ( TxId id = begin; id < end; ++id )
+            {
+                if ( !risks.live[id] )  continue;
+                
+                std::int64_t weight = static_cast<const D*>(this)->SettlementWeight( id, key );
+                totals.pool += risks.amount[id];
+                totals.win += weight > 0 ? risks.amount[id] : 0;
+                totals.weight += weight;
+            }
+            return totals;
+        }
+        
+        // Settlement splits the pool into chunks of this many risks for the threads - fixed so the chunks, and the
+        // order we add them up in, don't depend on how many threads we have
+        static constexpr std::size_t SettlementChunk = std::size_t{1} << 16;
+        
+        // Chunks for the first n risks
+        static std::size_t SettlementChunks( TxId n )
+        {
+            return ( (std::size_t)n + SettlementChunk - 1 ) / SettlementChunk;
+        }
+        
+        // Settle every risk with weight( tx_id ) > 0 into the map - the chunks are settled across the threads then
+        // merged in chunk order, calling check( risk ) on each winner in tx order as it goes in
+        template <typename WEIGHT, typename CHECK>
+        std::map< TxId, Risk > CollectWinners( const Settlement& settlement, WEIGHT&& weight, CHECK&& check ) const
+        {
+            auto pool = static_cast<const D*>(this);
+            std::vector< std::vector<Risk> > winners( SettlementChunks( settlement.tx ) );
+            
+            ParallelFor( winners.size(), [&]( std::size_t begin, std::size_t end ) {
+                for ( std::size_t c = begin; c < end; ++c )
+                    for ( TxId id = (TxId)( c * SettlementChunk ); id < (TxId)std::min( (std::size_t)settlement.tx, ( c + 1 ) * SettlementChunk ); ++id )
+                        if ( std::int64_t w = weight( id ); w > 0 )    winners[c].push_back( pool->MakeSettledRisk( settlement, id, w ) );
+            }, 1 );
+            
+            std::map< TxId, Risk > result;
+            for (auto& chunk : winners )
+                for (auto& risk : chunk )
+                {
+                    check( risk );
+                    result.emplace_hint( result.end(), risk.tx.id, std::move( risk ) );
+                }
+            return result;
+        }
+        
+        // Settlement weights for the risks [begin, end) into weight - 0 for the losers. One at a time by default
+        void SettlementWeights( const Settlement& settlement, TxId begin, TxId end, std::int64_t* weight ) const
+        {
+            for ( TxId id = begin; id < end; ++id )     weight[ id - begin ] = settlement.Weight( id );
+        }
+        
+        // Payout batch for submission - one column per field, the winners in tx order
+        struct PayoutColumns
+        {
+            std::span<TxId>         tx;
+            std::span<AccountId>    account;
+            std::span<Amount>       payout;
+            std::span<double>       payoff;     // Payout over amount, see Settlement::Payoff
+        };
+        
+        // Winners in each settlement chunk - add them up to size the PayoutColumns
+        std::vector<std::size_t> CountWinners( const Settlement& settlement ) const
+        {
+            std::vector<std::size_t> counts( SettlementChunks( settlement.tx ) );
+            ParallelFor( counts.size(), [&]( std::size_t begin, std::size_t end ) {
+                std::vector<std::int64_t> weight( SettlementChunk );
+                for ( std::size_t c = begin; c < end; ++c )
+                {
+                    TxId first = (TxId)( c * SettlementChunk ), last = (TxId)std::min( (std::size_t)settlement.tx, ( c + 1 ) * SettlementChunk );
+                    static_cast<const D*>(this)->SettlementWeights( settlement, first, last, weight.data() );
+                    counts[c] = std::count_if( weight.begin(), weight.begin() + ( last - first ), []( std::int64_t w ){ return w > 0; } );
+                }
+            }, 1 );
+            return counts;
+        }
+        
+        // Every winner's payout straight from the columns into the caller's - no Risk, no map, no formatting
+        // Each chunk starts where the counts before it end, so the threads fill their own stretch with no merge
+        // The columns need room for every winner. Returns how many we wrote
+        std::size_t ExportPayouts( const Settlement& settlement, const PayoutColumns& columns, const std::vector<std::size_t>& counts ) const
+        {
+            std::vector<std::size_t> offsets( counts.size() + 1 );
+            std::partial_sum( counts.begin(), counts.end(), offsets.begin() + 1 );
+            assert( columns.tx.size() >= offsets.back() && columns.account.size() >= offsets.back() );
+            assert( columns.payout.size() >= offsets.back() && columns.payoff.size() >= offsets.back() );
+            
+            ParallelFor( counts.size(), [&]( std::size_t begin, std::size_t end ) {
+                std::vector<std::int64_t> weight( SettlementChunk );
+                for ( std::size_t c = begin; c < end; ++c )
+                {
+                    TxId first = (TxId)( c * SettlementChunk ), last = (TxId)std::min( (std::size_t)settlement.tx, ( c + 1 ) * SettlementChunk );
+                    static_cast<const D*>(this)->SettlementWeights( settlement, first, last, weight.data() );
+                    
+                    std::size_t at = offsets[c];
+                    for ( TxId id = first; id < last; ++id )
+                    {
+                        std::int64_t w = weight[ id - first ];
+                        if ( w <= 0 )   continue;
+                        
+                        Amount payout = settlement.Payout( w );
+                        columns.tx[at] = id;
+                        columns.account[at] = risks.account[id];
+                        columns.payout[at] = payout;
+                        columns.payoff[at] = payout / (double)risks.amount[id];
+                        ++at;
+                    }
+                }
+            }, 1 );
+            return offsets.back();
+        }
+        
+        std::size_t ExportPayouts( const Settlement& settlement, const PayoutColumns& columns ) const
+        {
+            return ExportPayouts( settlement, columns, CountWinners( settlement ) );
+        }
+        
+        // Ditto to a file in the SnapshotFile layout, kind SnapshotFile::Payouts - the header has the pool's tx count,
+        // fees and total stake as a snapshot would, what the payouts add up to and the dust left over, then the tx,
+        // account, payout and payoff columns
+        // The columns are mapped onto the file and filled in place
+        bool ExportPayouts( const Settlement& settlement, const char* path ) const
+        {
+            SnapshotFile file;
+            if ( !file.Create( path, SnapshotFile::Payouts ) )     return false;
+            
+            file.header.tx = settlement.tx;
+            file.header.fees = settlement.fees;
+            file.header.total_stake = total_stake;
+            
+            auto counts = CountWinners( settlement );
+            std::size_t n = std::accumulate( counts.begin(), counts.end(), std::size_t{} );
+            PayoutColumns columns{ file.Place<TxId>( n ), file.Place<AccountId>( n ), file.Place<Amount>( n ), file.Place<double>( n ) };
+            if ( n > 0 && ( columns.tx.empty() || columns.account.empty() || columns.payout.empty() || columns.payoff.empty() ) )     return false;
+            
+            ExportPayouts( settlement, columns, counts );
+            file.header.paid_out = std::accumulate( columns.payout.begin(), columns.payout.end(), Amount{} );
+            file.header.dust = settlement.total_pool_value - file.header.paid_out;
+            return file.Finish( path );
+        }
+        
+        // Copy of everything the quotes read but not the risks themselves - O(levels) rather than O(risks)
+        // Good for ProFormaReturn, ProFormaPayoffCurve, CategoryMap and friends, not for settlement - it has no risks,
+        // so its tx stays 0 and anything that scans the risks sees none
+        D MakeSnapshot() const
+        {
+            D snapshot;
+            static_cast<const D*>(this)->CopyAggregates( snapshot );
+            return snapshot;
+        }
+        
+        // The derived pools add their own aggregates
+        void CopyAggregates( D& snapshot ) const
+        {
+            snapshot.fee_bps = fee_bps;
+            snapshot.total_stake = total_stake;
+            snapshot.category_stake = category_stake;
+            snapshot.level_stake = level_stake;
+        }
+        
+        // Generic scan - the derived pools shadow this with their running totals
+        std::int64_t TotalWinningWeight( Level level ) const
+        {
+            std::int64_t result{};
+            Key key = static_cast<const D*>(this)->ToKey( level );
+            ForEachWinner( level, [&]( TxId id ){ result += static_cast<const D*>(this)->SettlementWeight( id, key ); } );
+            return result;
+        }
+        
+        // Note that this mutates the pool - see ProFormaReturn for the const version
+        // Level is the outcome that we want to know about
+        auto ProFormaReturnHelper( const Event& event, Amount amount, Level level )
+        {
+            // Put the hypothetical risk into pool
+            auto tx_id = MakeRisk( event, amount, hypothetical_account );
+            return Settle( level ).GetRisk( tx_id );    // Empty if its a bust
+        }
+        
+        // Const version - we don't copy the pool, the hypothetical risk is overlaid on the pool totals
+        // Gives the same answer as ProFormaReturnHelper without mutating anything
+        // A stake MakeRisk wouldn't take gets an empty Risk too
+        auto ProFormaReturn( const Event& event, Amount amount, Level level ) const
+        {
+            Risk risk = MakeHypotheticalRisk( event, amount );
+            
+            if ( !risk.IsWinner( level ) || !Fits( TotalPool(), amount ) )  return Risk{};  // Its a bust
+            
+            static_cast<const D*>(this)->MakeProFormaRisk( risk, level );
+            return risk;                                // We won
+        }
+        
+        // One hypothetical stake for ProFormaReturnBatch
+        struct Quote
+        {
+            Event   event;
+            Amount  amount{};
+            Level   level{};
+        };
+        
+        // ProFormaReturn for each quote - results[i] is the answer for quotes[i], results needs room for them all
+        // The quotes share the pool aggregates, each level's winning totals are looked up once for the whole batch
+        std::span<Risk> ProFormaReturnBatch( std::span<const Quote> quotes, std::span<Risk> results ) const
+        {
+            assert( results.size() >= quotes.size() );
+            auto pool = static_cast<const D*>(this);
+            
+            std::map< Level, SettlementTotals > totals;
+            for (const auto& quote : quotes )     totals.try_emplace( quote.level );
+            pool->MakeWinningTotals( totals );
+            
+            for ( std::size_t i = 0; i < quotes.size(); ++i )
+            {
+                Risk risk = MakeHypotheticalRisk( quotes[i].event, quotes[i].amount );
+                if ( !risk.IsWinner( quotes[i].level ) || !Fits( TotalPool(), quotes[i].amount ) )
+                {
+                    results[i] = Risk{};                // Its a bust
+                    continue;
+                }
+                pool->MakeProFormaRisk( risk, quotes[i].level, totals.at( quotes[i].level ) );
+                results[i] = risk;
+            }
+            return results.first( quotes.size() );
+        }
+        
+        // Payoff for every stake amount at every level in MakeLevelSet()
+        struct PayoffSurface
+        {
+            std::vector<Level>  levels;     // Rows
+            std::vector<Amount> amounts;    // Columns
+            std::vector<double> payoff;     // Row major, levels.size() x amounts.size()
+            
+            double operator()( std::size_t row, std::size_t column ) const
+            {
+                return payoff[ row * amounts.size() + column ];
+            }
+        };
+        
+        // ProFormaPayoffCurve for many amounts at once - shows the slippage as the stake grows
+        // Given a level's winning totals the payoff is closed form in the amount, so we look the totals up once per
+        // level and fill in the row. The rows are independent so we spread the levels over the threads
+        // An amount MakeRisk wouldn't take has payoff 0 throughout, as ProFormaReturn gives it
+        PayoffSurface MakePayoffSurface( const Event& event, std::span<const Amount> amounts ) const
+        {
+            auto pool = static_cast<const D*>(this);
+            PayoffSurface surface;
+            surface.amounts.assign( amounts.begin(), amounts.end() );
+            
+            std::map< Level, SettlementTotals > totals;
+            ForEachLevel( [&]( auto level ){ totals.try_emplace( level ); } );
+            pool->MakeWinningTotals( totals );
+            
+            std::vector< const std::pair< const Level, SettlementTotals >* > rows;
+            for (const auto& row : totals ) 
+            {
+                surface.levels.push_back( row.first );
+                rows.push_back( &row );
+            }
+            surface.payoff.resize( rows.size() * amounts.size() );
+            
+            ParallelFor( rows.size(), [&]( std::size_t begin, std::size_t end ) {
+                Risk risk = MakeHypotheticalRisk( event, Amount{} );
+                for ( std::size_t i = begin; i < end; ++i )
+                {
+                    const auto& [level,level_totals] = *rows[i];
+                    double* row = surface.payoff.data() + i * amounts.size();
+                    
+                    if ( !risk.IsWinner( level ) )          // Its a bust whatever we stake
+                    {
+                        std::fill( row, row + amounts.size(), 0. );
+                        continue;
+                    }
+                    for ( std::size_t j = 0; j < amounts.size(); ++j )
+                    {
+                        if ( !Fits( level_totals.pool, amounts[j] ) )
+                        {
+                            row[j] = 0.;                // A stake MakeRisk wouldn't take
+                            continue;
+                        }
+                        risk.tx.amount = amounts[j];
+                        pool->MakeProFormaRisk( risk, level, level_totals );
+                        row[j] = risk.payoff;
+                    }
+                }
+            } );
+            return surface;
+        }
+        
+        // Fill in the totals for every level in the map - one lookup each by default
+        void MakeWinningTotals( std::map< Level, SettlementTotals >& totals ) const
+        {
+            auto pool = static_cast<const D*>(this);
+            for (auto& [level,total] : totals )
+                total = { TotalPool(), pool->TotalWinningAmount( level ), pool->TotalWinningWeight( level ) };
+        }
+        
+        // The risk MakeRisk would have made - not put in the pool
+        Risk MakeHypotheticalRisk( const Event& event, Amount amount ) const
+        {
+            Risk risk{ event };
+            risk.tx.id = tx;                            // The id MakeRisk would have given it
+            risk.tx.amount = amount;
+            risk.tx.client_account = hypothetical_account;
+            return risk;
+        }
+        
+        // Set of unique end points
+        std::set<Level> MakeLevelSet() const
+        {
+            std::set<Level> levels;
+          
+            for (const auto& [key,amount] : level_stake )    levels.insert( static_cast<const D*>(this)->ToLevel( key ) );
+            
+            if ( levels.empty() )   return levels;
+        
+            // If dealing with numbers add one tick under/over
+            if constexpr ( std::is_arithmetic_v<Level> )
+            {
+                auto min = *levels.begin();
+                auto max = *levels.rbegin();
+                
+                levels.insert(min-1);   // One tick under
+                levels.insert(max+1);   // One tick over
+            }
+            
+            return levels;
+        }
+        
+        template <typename CALLABLE, typename ... ARGS >
+        void ForEachLevel( CALLABLE&& f, ARGS&&... args ) const
+        {
+            auto levels = MakeLevelSet();
+            for (auto l : levels ) f( l, std::forward<ARGS>(args)... );
+        }
+        
+        Amount TotalPool() const
+        {
+            return total_stake;
+        }
+        
+        // What amounts have won at a given closing price/event ?
+        // Generic scan - the derived pools shadow this with a lookup on their running totals
+        Amount TotalWinningAmount( Level level ) const
+        {
+            Amount  result{};
+            ForEachWinner( level, [&]( TxId id ){ result += risks.amount[id]; } );
+            return result;
+        }
+        
+        // What is the total winning amount for each price level - note that we mutuate here to get the unique price set
+        Amount PoolWinningAmount() const
+        {
+            Amount result{};
+            ForEachLevel( [&]( auto level ){ result += static_cast<const D*>(this)->TotalWinningAmount( level ); } );
+            return result;
+        }
+        
+        std::size_t CountWinningRisks( Level level ) const
+        {
+            std::size_t n{0};
+            ForEachWinner( level, [&]( TxId ){ ++n; } );
+            return n;
+        }
+        
+        Amount Fees() const
+        {
+            return Fees( TotalPool() );
+        }
+        
+        // Fees on a pool of this size - rounded down, any rounding dust on the payouts goes to the pool account too
+        Amount Fees( Amount total ) const
+        {
+            return MulDiv( total, fee_bps, 10000 );
+        }
+        
+        virtual std::string PoolManagerAccount() const override 
+        {
+            return "Pool_Manager_Address";
+        }
+        
+        virtual std::string PoolAccount() const override
+        {
+            return "Pool_Account_Address";
+        }
+        
+        virtual std::map< std::string, double > CategoryMap() const override
+        {
+            std::map< std::string, double > result;
+            for (auto& [category,amount] : category_stake )   result[ category ] = amount;
+            return result;
+        }
+          
+        // Const so it can quote off a pinned snapshot
+        std::map< Level, double > ProFormaPayoffCurve( const Event& event, Amount amount ) const
+        {
+            std::map< Level, double > result;
+            ForEachLevel(  [&]( auto level ){
+                auto b = ProFormaReturn( event, amount, level );
+                result[ level ] = b.payoff;
+            } ) ;
+            return result;
+        }
+    };
+
+    // Now the specific implementation of a Mutex pool
+    struct MutexPool : Pool< MutexPool, MutexEvent<DefaultTX> >
+    {
+        using Super = Pool< MutexPool, MutexEvent<DefaultTX> >;
+        
+        InternTable outcomes;   // Event names - the columns and running totals only see the ids
+        
+        static constexpr std::uint32_t PoolKind = 1;     // In snapshot and journal headers - neither reads into the other pool
+        
+        Key InternKey( const Event& event )
+        {
+            return outcomes.Intern( event.event );
+        }
+        
+        // Our categories are the outcomes, so CategoryMap comes straight off level_stake - no strings while we take risks
+        void StakeCategory( Side, Key, Amount ) {}
+        
+        virtual std::map< std::string, double > CategoryMap() const override
+        {
+            std::map< std::string, double > result;
+            for (const auto& [key,amount] : level_stake )     result[ ToLevel( key ) ] = amount;
+            return result;
+        }
+        
+        Key ToKey( const Level& level ) const
+        {
+            return outcomes.Find( level );
+        }
+        
+        Level ToLevel( Key key ) const
+        {
+            return outcomes.Name( key );
+        }
+        
+        void CopyAggregates( MutexPool& snapshot ) const
+        {
+            Super::CopyAggregates( snapshot );
+            snapshot.outcomes = outcomes;
+        }
+        
+        Risk MakeEvent( Side, Key key ) const
+        {
+            Risk risk{ outcomes.Name( key ) };
+            risk.outcome = key;
+            return risk;
+        }
+        
+        InternTable* KeyTable()                 { return &outcomes; }
+        const InternTable* KeyTable() const     { return &outcomes; }
+        
+        // No sides - the level is the event name
+        bool ParseRisk( std::string_view, std::string_view level, Side& side, Key& key )
+        {
+            side = Side::Neither;
+            key = outcomes.Intern( level );
+            return true;
+        }
+        
+        // The key has to be an outcome we have interned
+        bool ValidRisk( Side side, Key key ) const
+        {
+            return side == Side::Neither && key >= 0 && std::size_t( key ) < outcomes.names.size();
+        }
+        
+        bool WriteSections( SnapshotFile& file ) const
+        {
+            return Super::WriteSections( file ) && file.Put( outcomes.names );
+        }
+        
+        bool MapSections( SnapshotFile& file )
+        {
+            if ( !Super::MapSections( file ) )  return false;
+            outcomes = {};
+            for (const auto& name : file.GetStrings() )     outcomes.Intern( name );
+            // Levels are outcome ids, so they have to name one of the outcomes we just read
+            for (const auto& [level,amount] : level_stake )
+                if ( level < 0 || std::size_t( level ) >= outcomes.names.size() )  file.bad = true;
+            return !file.bad;
+        }
+        
+        // Only the risks on this event win
+        Amount TotalWinningAmount( Level level ) const
+        {
+            auto it = level_stake.find( ToKey( level ) );
+            return it == level_stake.end() ? Amount{} : it->second;
+        }
+        
+        // The winners share the pool by their amounts
+        std::int64_t SettlementWeight( TxId id, Key key ) const
+        {
+            return Event::Wins( risks.side[id], risks.level[id], key ) ? risks.amount[id] : 0;
+        }
+        
+        std::int64_t TotalWinningWeight( Level level ) const
+        {
+            return TotalWinningAmount( level );
+        }
+        
+        Risk MakeSettledRisk( const Settlement& settlement, TxId id, std::int64_t weight ) const
+        {
+            Risk risk = GetRisk( id );
+            Amount amount = risks.amount[id];
+            
+            risk.pool_share = amount / (double)settlement.total_pool_value;
+            risk.winnings_share = amount / (double)settlement.total_win_value;
+            risk.payoff = settlement.total_pool_value / (double)settlement.total_win_value;
+            risk.tx.payout = settlement.Payout( weight );
+            return risk;
+        }
+        
+        // Pure - the winners and totals go to the report sink if the caller wants them
+        std::map< TxId, Risk > MakeWinningRisks( Level level, Report& report = NoReport ) const
+        {
+            // The totals come off the running aggregates so the one pass over the risks can pay out as it goes
+            auto settlement = Settle( level );
+       
+            //Checks
+            Amount total_payout{}, total_winning_amount{};
+            Amount winners{};
+            
+            // Pick the winners across the threads - we don't mtate risks
+            auto winning_risks = CollectWinners( settlement, [&]( TxId tx ){ return settlement.Weight( tx ); }, [&]( const Risk& winning_risk ) {
+                total_payout += winning_risk.tx.payout;
+                total_winning_amount += winning_risk.tx.amount;
+                ++winners;
+            } );
+            
+            // Rounding each payout down leaves under 1 Wei per winner - the dust goes to the pool account with the fees
+            Amount dust = settlement.total_pool_value - total_payout;
+            assert( Close( total_winning_amount, settlement.total_win_value ) );
+            assert( winners == 0 || ( dust >= 0 && dust < winners ) );
+           
+            report.Winners( winning_risks );
+            report.Total( ReportField::Fees, settlement.fees );
+            report.Total( ReportField::PoolValue, TotalPool() );
+            report.Total( ReportField::TotalPayout, total_payout );
+            report.Total( ReportField::Dust, dust );
+     
+            return winning_risks;
+        }
+        
+        // Settle a hypothetical winning risk as if it were in the pool - same arithmetic as MakeWinningRisks
+        void MakeProFormaRisk( Risk& risk, Level level ) const
+        {
+            MakeProFormaRisk( risk, level, { TotalPool(), TotalWinningAmount( level ), TotalWinningWeight( level ) } );
+        }
+        
+        // Ditto given the pool's totals at the level - the weight is the winning amount again
+        void MakeProFormaRisk( Risk& risk, Level, const SettlementTotals& totals ) const
+        {
+            Amount total = totals.pool + risk.tx.amount;
+            Amount total_pool_value = total - Fees( total );
+            Amount total_win_value = totals.win + risk.tx.amount;
+            
+            risk.pool_share = risk.tx.amount / (double)total_pool_value;
+            risk.winnings_share = risk.tx.amount / (double)total_win_value;
+            risk.payoff = total_pool_value / (double)total_win_value;
+            risk.tx.payout = total_win_value > 0 ? MulDiv( risk.tx.amount, total_pool_value, total_win_value ) : 0;    // A 0 stake nobody else wins with
+        }
+    };
+
+    // Branch free settlement kernel for the LongShort risk columns
+    // A risk wins when its signed distance to the pin - +1 for a Long, -1 for a Short times ( level - price ) - is positive
+    // One fused streaming pass over the columns gives the winner mask, the inverse distance weights and every total
+    // settlement needs - the pool, the winning amount and the weights. The payouts need those totals so they come
+    // from a second pass over the winners only, see Pool::Settlement
+    // The pass has scalar, AVX2 and AVX-512 versions, we pick the widest the CPU has at run time
+    // Everything is integer so every version gives exactly the same answer whatever order it adds up in
+    struct LongShortKernel
+    {
+        struct Columns
+        {
+            const std::int64_t* amount;
+            const Side*         side;
+            const std::int32_t* price;
+            const std::uint8_t* live;
+            std::size_t         n;
+        };
+        
+        using Totals = SettlementTotals;
+        
+        // Fills in weight, n of them - 0 for the losers. Pass nullptr if you only want the totals
+        static Totals Settle( const Columns& c, std::int32_t level, std::int64_t* weight )
+        {
+            Totals totals;
+            
+            switch ( Detect() )
+            {
+#if defined(__x86_64__)
+                case Isa::AVX512 :  SweepAVX512( c, level, weight, totals );  break;
+                case Isa::AVX2 :    SweepAVX2( c, level, weight, totals );    break;
+#endif
+                default :           SweepScalar( c, level, 0, c.n, weight, totals );
+            }
+            return totals;
+        }
+        
+        enum class Isa { Scalar, AVX2, AVX512 };
+        
+        static Isa Detect()
+        {
+#if defined(__x86_64__) && ( defined(__GNUC__) || defined(__clang__) )
+            static const Isa isa = __builtin_cpu_supports( "avx512f" ) ? Isa::AVX512 : __builtin_cpu_supports( "avx2" ) ? Isa::AVX2 : Isa::Scalar;
+            return isa;
+#else
+            return Isa::Scalar;
+#endif
+        }
+        
+        // The risks [i, end) - the vector versions use this for their tails, and for a block with a distance too far
+        // for their 32 bit lanes. Here the distance is taken in 64 bits
+        static void SweepScalar( const Columns& c, std::int32_t level, std::size_t i, std::size_t end, std::int64_t* weight, Totals& totals )
+        {
+            for ( ; i < end; ++i )
+            {
+                std::int64_t sign = ( c.side[i] == Side::Long ) - ( c.side[i] == Side::Short );
+                std::int64_t distance = sign * ( (std::int64_t)level - c.price[i] );
+                bool winner = c.live[i] && distance > 0;
+                
+                std::int64_t w = winner ? InverseDistanceOne / distance : 0;
+                if ( weight )   weight[i] = w;
+                totals.pool += c.live[i] ? c.amount[i] : 0;
+                totals.win += winner ? c.amount[i] : 0;
+                totals.weight += w;
+            }
+        }
+        
+#if defined(__x86_64__)
+        // The vectors have no integer divide so we take floor( InverseDistanceOne / d ) in double - that is exact, the quotient
+        // is never closer to the next integer than 1/d and the rounding error is under 2^-21/d. Then 2^52 + w has w in its low
+        // mantissa bits, which gets us back to int64 without AVX-512DQ
+        __attribute__((target("avx2")))
+        static void SweepAVX2( const Columns& c, std::int32_t level, std::int64_t* weight, Totals& totals )
+        {
+            const __m128i lng = _mm_set1_epi32( (std::int32_t)Side::Long ), shrt = _mm_set1_epi32( (std::int32_t)Side::Short );
+            const __m128i lvl = _mm_set1_epi32( level ), zero = _mm_setzero_si128(), min = _mm_set1_epi32( std::numeric_limits<std::int32_t>::min() );
+            const __m256d one = _mm256_set1_pd( (double)InverseDistanceOne ), magic = _mm256_set1_pd( 0x1p52 );
+            __m256i pool = _mm256_setzero_si256(), win = _mm256_setzero_si256(), total = _mm256_setzero_si256();
+            
+            std::size_t i = 0;
+            for ( ; i + 4 <= c.n; i += 4 )
+            {
+                std::int32_t live;
+                std::memcpy( &live, c.live + i, 4 );
+                __m128i side = _mm_loadu_si128( (const __m128i*)( c.side + i ) );
+                __m128i price = _mm_loadu_si128( (const __m128i*)( c.price + i ) );
+                __m128i difference = _mm_sub_epi32( lvl, price );
+                
+                // A difference that overflowed, or INT_MIN the sign can't negate, needs 64 bits - rare, so the block goes scalar
+                __m128i wide = _mm_or_si128( _mm_and_si128( _mm_xor_si128( lvl, price ), _mm_xor_si128( lvl, difference ) ), _mm_cmpeq_epi32( difference, min ) );
+                if ( _mm_movemask_ps( _mm_castsi128_ps( wide ) ) )
+                {
+                    SweepScalar( c, level, i, i + 4, weight, totals );
+                    continue;
+                }
+                
+                // cmpeq gives -1 for true so Short - Long is the sign
+                __m128i sign = _mm_sub_epi32( _mm_cmpeq_epi32( side, shrt ), _mm_cmpeq_epi32( side, lng ) );
+                __m128i distance = _mm_mullo_epi32( sign, difference );
+                __m128i alive = _mm_cmpgt_epi32( _mm_cvtepu8_epi32( _mm_cvtsi32_si128( live ) ), zero );
+                __m256i mask = _mm256_cvtepi32_epi64( _mm_and_si128( _mm_cmpgt_epi32( distance, zero ), alive ) );
+                __m256i amount = _mm256_loadu_si256( (const __m256i*)( c.amount + i ) );
+                
+                __m256d w = _mm256_and_pd( _mm256_castsi256_pd( mask ), _mm256_floor_pd( _mm256_div_pd( one, _mm256_cvtepi32_pd( distance ) ) ) );
+                __m256i wi = _mm256_sub_epi64( _mm256_castpd_si256( _mm256_add_pd( w, magic ) ), _mm256_castpd_si256( magic ) );
+                if ( weight )   _mm256_storeu_si256( (__m256i*)( weight + i ), wi );
+                pool = _mm256_add_epi64( pool, _mm256_and_si256( _mm256_cvtepi32_epi64( alive ), amount ) );
+                win = _mm256_add_epi64( win, _mm256_and_si256( mask, amount ) );
+                total = _mm256_add_epi64( total, wi );
+            }
+            
+            totals.pool += Sum( pool );
+            totals.win += Sum( win );
+            totals.weight += Sum( total );
+            SweepScalar( c, level, i, c.n, weight, totals );
+        }
+        
+        __attribute__((target("avx2")))
+        static std::int64_t Sum( __m256i v )
+        {
+            alignas(32) std::int64_t x[4];
+            _mm256_store_si256( (__m256i*)x, v );
+            return x[0] + x[1] + x[2] + x[3];
+        }
+        
+        __attribute__((target("avx512f")))
+        static void SweepAVX512( const Columns& c, std::int32_t level, std::int64_t* weight, Totals& totals )
+        {
+            const __m256i lng = _mm256_set1_epi32( (std::int32_t)Side::Long ), shrt = _mm256_set1_epi32( (std::int32_t)Side::Short );
+            const __m256i lvl = _mm256_set1_epi32( level ), zero = _mm256_setzero_si256(), min = _mm256_set1_epi32( std::numeric_limits<std::int32_t>::min() );
+            const __m512d one = _mm512_set1_pd( (double)InverseDistanceOne ), magic = _mm512_set1_pd( 0x1p52 );
+            __m512i pool = _mm512_setzero_si512(), win = _mm512_setzero_si512(), total = _mm512_setzero_si512();
+            
+            std::size_t i = 0;
+            for ( ; i + 8 <= c.n; i += 8 )
+            {
+                std::int64_t live;
+                std::memcpy( &live, c.live + i, 8 );
+                __m256i side = _mm256_loadu_si256( (const __m256i*)( c.side + i ) );
+                __m256i price = _mm256_loadu_si256( (const __m256i*)( c.price + i ) );
+                __m256i difference = _mm256_sub_epi32( lvl, price );
+                
+                __m256i wide = _mm256_or_si256( _mm256_and_si256( _mm256_xor_si256( lvl, price ), _mm256_xor_si256( lvl, difference ) ), _mm256_cmpeq_epi32( difference, min ) );
+                if ( _mm256_movemask_ps( _mm256_castsi256_ps( wide ) ) )
+                {
+                    SweepScalar( c, level, i, i + 8, weight, totals );
+                    continue;
+                }
+                
+                __m256i sign = _mm256_sub_epi32( _mm256_cmpeq_epi32( side, shrt ), _mm256_cmpeq_epi32( side, lng ) );
+                __m256i distance = _mm256_mullo_epi32( sign, difference );
+                __m256i alive = _mm256_cmpgt_epi32( _mm256_cvtepu8_epi32( _mm_cvtsi64_si128( live ) ), zero );
+                __mmask8 live_mask = (__mmask8)_mm256_movemask_ps( _mm256_castsi256_ps( alive ) );
+                __mmask8 mask = live_mask & (__mmask8)_mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpgt_epi32( distance, zero ) ) );
+                __m512i amount = _mm512_loadu_si512( c.amount + i );
+                
+                // Zero masked forms all the way - the unmasked ones start from an undefined register
+                __m512d w = _mm512_maskz_roundscale_pd( mask, _mm512_maskz_div_pd( mask, one, _mm512_maskz_cvtepi32_pd( mask, distance ) ), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC );
+                __m512i wi = _mm512_sub_epi64( _mm512_castpd_si512( _mm512_add_pd( w, magic ) ), _mm512_castpd_si512( magic ) );
+                if ( weight )   _mm512_storeu_si512( weight + i, wi );
+                pool = _mm512_mask_add_epi64( pool, live_mask, pool, amount );
+                win = _mm512_mask_add_epi64( win, mask, win, amount );
+                total = _mm512_add_epi64( total, wi );
+            }
+            
+            totals.pool += Sum( pool );
+            totals.win += Sum( win );
+            totals.weight += Sum( total );
+            SweepScalar( c, level, i, c.n, weight, totals );
+        }
+        
+        __attribute__((target("avx512f")))
+        static std::int64_t Sum( __m512i v )
+        {
+            alignas(64) std::int64_t x[8];
+            _mm512_store_si512( x, v );
+            return x[0] + x[1] + x[2] + x[3] + x[4] + x[5] + x[6] + x[7];
+        }
+#endif
+    };
+
+    // Now the specific implementation of a LongShort pool
+    struct LongShortPool : Pool< LongShortPool, LongShortEvent<DefaultTX> >
+    {
+        using Super = Pool< LongShortPool, LongShortEvent<DefaultTX> >;
+        
+        FenwickIndex< Level, Amount >       long_stake;     // Amount at risk per price - Longs
+        FenwickIndex< Level, Amount >       short_stake;    // Ditto - Shorts
+        FenwickIndex< Level, std::int64_t > long_count;     // Number of risks per price - Longs
+        FenwickIndex< Level, std::int64_t > short_count;    // Ditto - Shorts
+        
+        static constexpr std::uint32_t PoolKind = 2;
+        
+        void IndexRisk( Side side, Key price, Amount amount, int sign )
+        {
+            if ( side == Side::Long )
+            {
+                long_stake.Add( price, sign * amount );
+                long_count.Add( price, sign );
+            }
+            if ( side == Side::Short )
+            {
+                short_stake.Add( price, sign * amount );
+                short_count.Add( price, sign );
+            }
+        }
+        
+        // Both sides' Fenwick indices in one merge each
+        void IndexStakes( std::span< const std::tuple< Side, Key, StakeGroup > > stakes )
+        {
+            std::vector< std::pair< Level, Amount > > amounts[2];
+            std::vector< std::pair< Level, std::int64_t > > counts[2];
+            for (const auto& [side,price,group] : stakes )
+            {
+                if ( side != Side::Long && side != Side::Short )    continue;
+                amounts[ (int)side ].emplace_back( price, group.amount );
+                counts[ (int)side ].emplace_back( price, group.count );
+            }
+            long_stake.Add( amounts[ (int)Side::Long ] );
+            long_count.Add( counts[ (int)Side::Long ] );
+            short_stake.Add( amounts[ (int)Side::Short ] );
+            short_count.Add( counts[ (int)Side::Short ] );
+        }
+        
+        // Long or Short at an integer price
+        bool ParseRisk( std::string_view side_field, std::string_view price, Side& side, Key& key )
+        {
+            if ( side_field == "Long" )         side = Side::Long;
+            else if ( side_field == "Short" )   side = Side::Short;
+            else                                return false;
+            return CsvScanner::Parse( price, key );
+        }
+        
+        // Any price will do
+        bool ValidRisk( Side side, Key ) const
+        {
+            return side == Side::Long || side == Side::Short;
+        }
+        
+        void CopyAggregates( LongShortPool& snapshot ) const
+        {
+            Super::CopyAggregates( snapshot );
+            snapshot.long_stake = long_stake;
+            snapshot.short_stake = short_stake;
+            snapshot.long_count = long_count;
+            snapshot.short_count = short_count;
+        }
+        
+        // The Fenwick indices go in as they are, tree and all, so there is nothing to rebuild
+        bool WriteSections( SnapshotFile& file ) const
+        {
+            bool ok = Super::WriteSections( file );
+            ForEachIndex( [&]( const auto& index ) {
+                ok = ok && file.Put( index.keys.data(), index.keys.size() ) && file.Put( index.values.data(), index.values.size() )
+                        && file.Put( index.tree.data(), index.tree.size() );
+            } );
+            return ok;
+        }
+        
+        // The tree is one longer than the values it sums, or empty with them
+        bool MapSections( SnapshotFile& file )
+        {
+            if ( !Super::MapSections( file ) )  return false;
+            ForEachIndex( [&]( auto& index ) {
+                using Value = typename std::remove_reference_t<decltype( index )>::Value;
+                auto keys = file.Get<Level>();
+                auto values = file.Get<Value>( keys.size() );
+                auto tree = file.Get<Value>();
+                if ( ( tree.size() != keys.size() + 1 && !tree.empty() ) || ( tree.empty() && !keys.empty() )
+                    || !std::is_sorted( keys.begin(), keys.end() ) )    file.bad = true;
+                if ( file.bad )     return;
+                index.keys.assign( keys.begin(), keys.end() );
+                index.values.assign( values.begin(), values.end() );
+                index.tree.assign( tree.begin(), tree.end() );
+            } );
+            return !file.bad;
+        }
+        
+        // Call f( index ) on the four Fenwick indices in a fixed order
+        template <typename SELF, typename CALLABLE>
+        static void ForEachIndex( SELF& self, CALLABLE&& f )
+        {
+            f( self.long_stake );
+            f( self.short_stake );
+            f( self.long_count );
+            f( self.short_count );
+        }
+        
+        template <typename CALLABLE>
+        void ForEachIndex( CALLABLE&& f )         { ForEachIndex( *this, f ); }
+        
+        template <typename CALLABLE>
+        void ForEachIndex( CALLABLE&& f ) const   { ForEachIndex( *this, f ); }
+        
+        // Longs priced under the level plus Shorts priced over it - O(log L)
+        Amount TotalWinningAmount( Level level ) const
+        {
+            return long_stake.SumBelow( level ) + short_stake.SumAbove( level );
+        }
+        
+        // The winners share the pool by their inverse distance to the pin
+        std::int64_t SettlementWeight( TxId id, Key key ) const
+        {
+            return Event::InverseDistanceWeight( risks.side[id], risks.level[id], key );
+        }
+        
+        std::int64_t TotalWinningWeight( Level level ) const
+        {
+            return TotalWinningInverseDistance( level );
+        }
+        
+        Risk MakeSettledRisk( const Settlement& settlement, TxId id, std::int64_t weight ) const
+        {
+            Risk risk = GetRisk( id );
+            Amount amount = risks.amount[id];
+            Amount total_pool_value = settlement.total_pool_value, total_win_value = settlement.total_win_value;
+            
+            risk.pool_share = amount / (double)total_pool_value;
+            risk.winnings_share = amount / (double)total_win_value;
+            risk.prima_facie_payoff = total_pool_value / (double)total_win_value;
+            risk.prima_facie_payout = total_win_value > 0 ? MulDiv( amount, total_pool_value, total_win_value ) : 0;   // Only 0 stakes won
+            
+            // Adjust the amount in proportion to the distance to the pin
+            risk.inverse_distance_to_the_pin = weight / (double)InverseDistanceOne;
+            risk.inverse_distance_to_pin_normalised = weight / (double)settlement.total_weight;
+            risk.adjusted_amount = MulDiv( total_win_value, weight, settlement.total_weight );     // Redistribute the winning pool based on the inverse distance
+            risk.tx.payout = settlement.Payout( weight );
+            risk.payoff = risk.tx.payout / (double)amount;
+            return risk;
+        }
+        
+        // Pure - the winners and totals go to the report sink if the caller wants them
+        std::map< TxId, Risk > MakeWinningRisks( Level level, Report& report = NoReport ) const
+        {
+            // One fused pass over the columns for the weights and all the totals, chunk by chunk across the threads
+            // The chunk totals are integers added up in chunk order - the same answer as one serial pass
+            std::vector<std::int64_t> inverse_distance( risks.size() );
+            std::vector<SettlementTotals> partial( SettlementChunks( tx ) );
+            ParallelFor( partial.size(), [&]( std::size_t begin, std::size_t end ) {
+                for ( std::size_t c = begin; c < end; ++c )
+                {
+                    TxId first = (TxId)( c * SettlementChunk ), last = (TxId)std::min( (std::size_t)tx, ( c + 1 ) * SettlementChunk );
+                    partial[c] = LongShortKernel::Settle( MakeColumns( first, last ), level, inverse_distance.data() + first );
+                }
+            }, 1 );
+            
+            SettlementTotals totals;
+            for (const auto& chunk : partial )  totals += chunk;
+            auto settlement = Settle( level, totals );
+            Amount fees = settlement.fees;
+            
+            //Checks
+            Amount total_prima_facie_payout{}, total_payout{};
+            Amount winners{};
+            
+            // Then one output pass - pick up the winners, the losers have no inverse distance
+            auto winning_risks = CollectWinners( settlement, [&]( TxId tx ){ return inverse_distance[tx]; }, [&]( const Risk& winning_risk ) {
+                total_prima_facie_payout += winning_risk.prima_facie_payout;
+                total_payout += winning_risk.tx.payout;
+                ++winners;
+            } );
+            
+            // Rounding each payout down leaves under 1 Wei per winner - the dust goes to the pool account with the fees
+            Amount total_pool_value = settlement.total_pool_value;
+            Amount dust = total_pool_value - total_payout;
+            assert( Close( totals.pool, TotalPool() ) );
+            assert( Close( totals.win, TotalWinningAmount( level ) ) );
+            assert( Close( totals.weight, TotalWinningInverseDistance( level ) ) );
+            assert( winners == 0 || ( dust >= 0 && dust < winners ) );
+            assert( winners == 0 || totals.win == 0 || ( total_pool_value - total_prima_facie_payout >= 0 && total_pool_value - total_prima_facie_payout < winners ) );
+            
+            report.Total( ReportField::ClosingPrice, level );
+            report.Winners( winning_risks );
+            report.Total( ReportField::PrimaFaciePayout, total_prima_facie_payout );
+            report.Total( ReportField::Fees, fees );
+            report.Total( ReportField::PoolValue, totals.pool );
+            report.Total( ReportField::TotalPayout, total_payout );
+            report.Total( ReportField::Dust, dust );
+            
+            return winning_risks;
+        }
+        
+        // The kernel's view of the risks [begin, end)
+        LongShortKernel::Columns MakeColumns( TxId begin, TxId end ) const
+        {
+            return { risks.amount.data() + begin, risks.side.data() + begin, risks.level.data() + begin, risks.live.data() + begin, (std::size_t)( end - begin ) };
+        }
+        
+        // Pool::SettlementWeights through the kernel
+        void SettlementWeights( const Settlement& settlement, TxId begin, TxId end, std::int64_t* weight ) const
+        {
+            LongShortKernel::Settle( MakeColumns( begin, end ), settlement.key, weight );
+        }
+        
+        // Pool::ScanTotals through the kernel
+        SettlementTotals ScanTotals( Level level, TxId begin, TxId end ) const
+        {
+            return LongShortKernel::Settle( MakeColumns( begin, end ), level, nullptr );
+        }
+        
+        // Sum of the inverse distance weights over the winners at this closing price - O(L) over the price counts
+        std::int64_t TotalWinningInverseDistance( Level level ) const
+        {
+            std::int64_t result{};
+            for ( std::size_t i = 0; i < long_count.keys.size() && long_count.keys[i] < level; ++i )
+                result += long_count.values[i] * ( InverseDistanceOne / ( (std::int64_t)level - long_count.keys[i] ) );
+            for ( std::size_t i = short_count.keys.size(); i > 0 && short_count.keys[i-1] > level; --i )
+                result += short_count.values[i-1] * ( InverseDistanceOne / ( (std::int64_t)short_count.keys[i-1] - level ) );
+            return result;
+        }
+        
+        // TotalWinningInverseDistance for every integer level in [lo, hi] at once
+        // Longs contribute count(p) * w(l-p) for p < l, Shorts count(p) * w(p-l) for p > l - each side is the
+        // price count histogram convolved with the w(d) = InverseDistanceOne / d kernel, so we do both with FFTs in O(G log G)
+        // G is the width of the grid from the lowest to the highest price or level - when that costs more than going
+        // level by level in O(levels L), eg few distinct prices or one far out price, we go level by level instead
+        // The weights are up to 2^32 so we convolve their high and low 16 bits separately, which keeps each total small
+        // enough to round back exactly. If the FFT error bound says it might not, we go level by level too
+        std::vector<std::int64_t> MakeInverseDistanceCurve( Level lo, Level hi ) const
+        {
+            std::vector<std::int64_t> result( (std::size_t)( (std::int64_t)hi - lo + 1 ) );
+            auto level_by_level = [&]{
+                for ( std::int64_t l = lo; l <= hi; ++l )     result[ l - lo ] = TotalWinningInverseDistance( (Level)l );
+                return result;
+            };
+            
+            // Grid covering the levels and every price
+            Level min = lo, max = hi;
+            for ( auto* index : { &long_count, &short_count } )
+            {
+                if ( index->keys.empty() )  continue;
+                min = std::min( min, index->keys.front() );
+                max = std::max( max, index->keys.back() );
+            }
+            std::size_t n = (std::size_t)( (std::int64_t)max - min + 1 ), m = 1;
+            while ( m < 2*n )   m <<= 1;
+            
+            std::size_t prices = long_count.keys.size() + short_count.keys.size();
+            if ( prices <= 32 || result.size() * prices <= 3 * m * std::bit_width( m ) )    return level_by_level();
+            
+            // Longs in the real part, Shorts reversed in the imaginary part - the kernel is real so they don't mix
+            std::vector< std::complex<double> > a( m ), high( m ), low( m );
+            for ( std::size_t i = 0; i < long_count.keys.size(); ++i )
+                a[ long_count.keys[i] - min ].real( long_count.values[i] );
+            for ( std::size_t i = 0; i < short_count.keys.size(); ++i )
+                a[ max - short_count.keys[i] ].imag( short_count.values[i] );
+            for ( std::size_t d = 1; d < n; ++d )
+            {
+                std::int64_t w = InverseDistanceOne / (std::int64_t)d;
+                high[d] = (double)( w >> 16 );
+                low[d] = (double)( w & 0xffff );
+            }
+            
+            // Worst case rounding error of an FFT convolution is about |a| |k| eps ( 13 log2 m + 3 ) - it has to stay
+            // well under 1/2 for the rounding to give the exact integers back
+            auto norm = []( const auto& x ) {
+                double sum = 0.;
+                for (const auto& v : x )     sum += std::norm( v );
+                return std::sqrt( sum );
+            };
+            double bound = norm( a ) * std::max( norm( high ), norm( low ) ) * std::numeric_limits<double>::epsilon() * ( 13. * std::bit_width( m ) + 3. );
+            if ( bound >= 0.25 )    return level_by_level();
+            
+            FFT( a, false );
+            FFT( high, false );
+            FFT( low, false );
+            for ( std::size_t i = 0; i < m; ++i )
+            {
+                high[i] *= a[i];
+                low[i] *= a[i];
+            }
+            FFT( high, true );
+            FFT( low, true );
+            
+            auto total = [&]( const auto& x, Level l ) {
+                return std::llround( x[ l - min ].real() ) + std::llround( x[ max - l ].imag() );
+            };
+            for ( Level l = lo; l <= hi; ++l )
+                result[ l - lo ] = total( high, l ) * 65536 + total( low, l );
+            return result;
+        }
+        
+        // In place iterative radix 2 FFT, size must be a power of 2
+        static void FFT( std::vector< std::complex<double> >& a, bool inverse )
+        {
+            std::size_t m = a.size();
+            for ( std::size_t i = 1, j = 0; i < m; ++i )
+            {
+                std::size_t bit = m >> 1;
+                for ( ; j & bit; bit >>= 1 )  j ^= bit;
+                j ^= bit;
+                if ( i < j )    std::swap( a[i], a[j] );
+            }
+            
+            // Twiddles straight from sin/cos rather than repeated multiplication - keeps the error down
+            std::vector< std::complex<double> > roots( m/2 );
+            for ( std::size_t i = 0; i < m/2; ++i )
+                roots[i] = std::polar( 1., ( inverse ? 2. : -2. ) * std::numbers::pi * i / m );
+            
+            for ( std::size_t len = 2; len <= m; len <<= 1 )
+                for ( std::size_t i = 0; i < m; i += len )
+                    for ( std::size_t j = 0; j < len/2; ++j )
+                    {
+                        auto u = a[i+j], v = a[i+j+len/2] * roots[ j * (m/len) ];
+                        a[i+j] = u + v;
+                        a[i+j+len/2] = u - v;
+                    }
+            
+            if ( inverse )  for ( auto& x : a )   x /= (double)m;
+        }
+        
+        // Settle a hypothetical winning risk as if it were in the pool - same arithmetic as MakeWinningRisks
+        void MakeProFormaRisk( Risk& risk, Level level ) const
+        {
+            MakeProFormaRisk( risk, level, { TotalPool(), TotalWinningAmount( level ), TotalWinningInverseDistance( level ) } );
+        }
+        
+        // Is one MakeInverseDistanceCurve over [lo, hi] worth it for this many levels in it - not if the range is much
+        // wider than the number of levels, the curve has an entry for every integer level in between
+        static bool CurveFits( Level lo, Level hi, std::size_t levels )
+        {
+            return levels > 32 && (std::uint64_t)( (std::int64_t)hi - lo ) <= 64 * (std::uint64_t)levels;
+        }
+        
+        // Many levels at once - the inverse distances come from one MakeInverseDistanceCurve over their range
+        // rather than O(L) each, as long as CurveFits
+        void MakeWinningTotals( std::map< Level, SettlementTotals >& totals ) const
+        {
+            if ( totals.empty() || !CurveFits( totals.begin()->first, totals.rbegin()->first, totals.size() ) )
+            {
+                Super::MakeWinningTotals( totals );
+                return;
+            }
+            
+            Level lo = totals.begin()->first;
+            auto inverse_distance = MakeInverseDistanceCurve( lo, totals.rbegin()->first );
+            for (auto& [level,total] : totals )
+                total = { TotalPool(), TotalWinningAmount( level ), inverse_distance[ level - lo ] };
+        }
+        
+        // Ditto given the pool's totals at the level
+        void MakeProFormaRisk( Risk& risk, Level level, const SettlementTotals& totals ) const
+        {
+            Amount total = totals.pool + risk.tx.amount;
+            Amount total_pool_value = total - Fees( total );
+            Amount total_win_value = totals.win + risk.tx.amount;
+            
+            risk.pool_share = risk.tx.amount / (double)total_pool_value;
+            risk.winnings_share = risk.tx.amount / (double)total_win_value;
+            risk.prima_facie_payoff = total_pool_value / (double)total_win_value;
+            // A 0 stake on a level nobody else wins with has 0 winnings to share - pay 0 rather than divide by it
+            risk.prima_facie_payout = total_win_value > 0 ? MulDiv( risk.tx.amount, total_pool_value, total_win_value ) : 0;
+            
+            std::int64_t weight = Event::InverseDistanceWeight( risk.side, risk.price, level );
+            std::int64_t total_inverse_distance_to_pin = totals.weight + weight;
+            bool shared = total_inverse_distance_to_pin > 0;
+            
+            risk.inverse_distance_to_the_pin = weight / (double)InverseDistanceOne;
+            risk.inverse_distance_to_pin_normalised = weight / (double)total_inverse_distance_to_pin;
+            risk.adjusted_amount = shared ? MulDiv( total_win_value, weight, total_inverse_distance_to_pin ) : 0;
+            risk.tx.payout = shared ? MulDiv( total_pool_value, weight, total_inverse_distance_to_pin ) : 0;
+            risk.payoff = risk.tx.payout / (double)risk.tx.amount;
+        }
+        
+        // Same curve as Pool::ProFormaPayoffCurve but we sweep up through the levels once
+        // Longs priced under the level join the winners as we go, Shorts priced at or under it drop out
+        // The inverse distances come from one MakeInverseDistanceCurve over the whole range if it CurveFits, otherwise
+        // level by level
+        std::map< Level, double > ProFormaPayoffCurve( const Event& event, Amount amount ) const
+        {
+            std::map< Level, double > result;
+            auto levels = MakeLevelSet();
+            if ( levels.empty() )   return result;
+            
+            Level lo = *levels.begin();
+            bool curve = CurveFits( lo, *levels.rbegin(), levels.size() );
+            auto inverse_distance = curve ? MakeInverseDistanceCurve( lo, *levels.rbegin() ) : std::vector<std::int64_t>{};
+            Risk risk = MakeHypotheticalRisk( event, amount );
+            
+            Amount long_win{}, short_win = short_stake.Prefix( short_stake.keys.size() );
+            std::size_t i = 0, j = 0;
+            for ( auto level : levels )
+            {
+                for ( ; i < long_stake.keys.size() && long_stake.keys[i] < level; ++i )     long_win += long_stake.values[i];
+                for ( ; j < short_stake.keys.size() && short_stake.keys[j] <= level; ++j )  short_win -= short_stake.values[j];
+                
+                if ( !risk.IsWinner( level ) || !Fits( TotalPool(), amount ) )
+                {
+                    result[ level ] = 0.;       // Its a bust
+                    continue;
+                }
+                std::int64_t weight = curve ? inverse_distance[ level - lo ] : TotalWinningInverseDistance( level );
+                MakeProFormaRisk( risk, level, { TotalPool(), long_win + short_win, weight } );
+                result[ level ] = risk.payoff;
+            }
+            return result;
+        }
+    };
+
+    // Thread pool where every worker has its own queue and the idle ones steal from the others
+    // A worker runs its own queue oldest first and steals the newest off the back of someone else's
+    struct WorkStealingPool
+    {
+        using Task = std::function<void()>;
+        
+        struct Queue
+        {
+            std::mutex          mutex;
+            std::deque<Task>    tasks;
+        };
+        
+        std::vector<Queue>          queues;         // One per worker
+        std::vector<std::thread>    workers;
+        std::atomic<std::size_t>    next{};         // Round robin for Submit
+        std::atomic<std::size_t>    queued{};       // Tasks sitting in the queues
+        std::atomic<std::size_t>    pending{};      // Tasks submitted and not finished
+        std::mutex                  mutex;          // For the condition variable
+        std::condition_variable     signal;         // Something was queued, everything finished or we are stopping
+        bool                        stop{};
+        
+        explicit WorkStealingPool( std::size_t threads = std::max( 1u, std::thread::hardware_concurrency() ) )
+            : queues( threads )
+        {
+            for ( std::size_t i = 0; i < threads; ++i )     workers.emplace_back( [this, i]{ Work( i ); } );
+        }
+        
+        ~WorkStealingPool()
+        {
+            {
+                std::lock_guard lock( mutex );
+                stop = true;
+            }
+            signal.notify_all();
+            for (auto& worker : workers )   worker.join();
+        }
+        
+        // Dealt out round robin - the stealing evens it up
+        void Submit( Task task )
+        {
+            auto& queue = queues[ next++ % queues.size() ];
+            ++pending;
+            {
+                std::lock_guard lock( queue.mutex );
+                queue.tasks.push_back( std::move( task ) );
+            }
+            {
+                std::lock_guard lock( mutex );
+                ++queued;
+            }
+            signal.notify_all();
+        }
+        
+        // Block until every task has finished - the calling thread pitches in rather than sit idle
+        void Wait()
+        {
+            for (;;)
+            {
+                Task task;
+                if ( Take( 0, task ) )
+                {
+                    Run( task );
+                    continue;
+                }
+                std::unique_lock lock( mutex );
+                signal.wait( lock, [this]{ return pending == 0 || queued > 0; } );
+                if ( pending == 0 )     return;
+            }
+        }
+        
+        // Our own queue from the front, anyone else's from the back
+        bool Take( std::size_t i, Task& task )
+        {
+            for ( std::size_t k = 0; k < queues.size(); ++k )
+            {
+                auto& queue = queues[ ( i + k ) % queues.size() ];
+                std::lock_guard lock( queue.mutex );
+                if ( queue.tasks.empty() )  continue;
+                
+                if ( k == 0 )
+                {
+                    task = std::move( queue.tasks.front() );
+                    queue.tasks.pop_front();
+                }
+                else
+                {
+                    task = std::move( queue.tasks.back() );
+                    queue.tasks.pop_back();
+                }
+                --queued;
+                return true;
+            }
+            return false;
+        }
+        
+        void Run( Task& task )
+        {
+            task();
+            if ( --pending == 0 )
+            {
+                std::lock_guard lock( mutex );
+                signal.notify_all();
+            }
+        }
+        
+        void Work( std::size_t i )
+        {
+            for (;;)
+            {
+                Task task;
+                if ( Take( i, task ) )
+                {
+                    Run( task );
+                    continue;
+                }
+                std::unique_lock lock( mutex );
+                signal.wait( lock, [this]{ return stop || queued > 0; } );
+                if ( stop && queued == 0 )  return;
+            }
+        }
+    };
+    
+    // Settles many pools at once - at market close we have thousands of them
+    // Every pool is a task on the work stealing pool, a pool with more than chunk risks is split into chunks and
+    // whichever chunk finishes last adds up their totals in chunk order. The biggest pools go in first so the
+    // last payout isn't held up by a big pool that started late
+    struct SettlementScheduler
+    {
+        WorkStealingPool    workers;
+        std::size_t         chunk{ std::size_t{1} << 20 };  // Risks per task
+        
+        std::vector< std::pair< std::size_t, std::function<void()> > > jobs;   // Pool size, submit its tasks
+        
+        // Settle the pool at the level into result when we Run() - both have to outlive it
+        template <typename POOL>
+        void Add( const POOL& pool, typename POOL::Level level, typename POOL::Settlement& result )
+        {
+            jobs.emplace_back( (std::size_t)pool.tx, [this, &pool, level, &result]{ Submit( pool, level, result ); } );
+        }
+        
+        void Run()
+        {
+            std::stable_sort( jobs.begin(), jobs.end(), []( const auto& a, const auto& b ){ return a.first > b.first; } );
+            for (auto& job : jobs )     job.second();
+            jobs.clear();
+            workers.Wait();
+        }
+        
+        template <typename POOL>
+        void Submit( const POOL& pool, typename POOL::Level level, typename POOL::Settlement& result )
+        {
+            using TxId = POOL::TxId;
+            
+            struct Reduction
+            {
+                std::vector<SettlementTotals>   partial;
+                std::atomic<std::size_t>        remaining;
+            };
+            
+            std::size_t n = pool.tx, chunks = std::max<std::size_t>( 1, ( n + chunk - 1 ) / chunk );
+            auto reduction = std::make_shared<Reduction>( std::vector<SettlementTotals>( chunks ), chunks );
+            
+            for ( std::size_t c = 0; c < chunks; ++c )
+            {
+                workers.Submit( [&pool, &result, level, reduction, c, begin = c * chunk, end = std::min( n, ( c + 1 ) * chunk )] {
+                    reduction->partial[c] = pool.ScanTotals( level, (TxId)begin, (TxId)end );
+                    if ( --reduction->remaining > 0 )   return;
+                    
+                    SettlementTotals totals;
+                    for (const auto& partial : reduction->partial )    totals += partial;
+                    result = pool.Settle( level, totals );
+                } );
+            }
+        }
+    };
+    
+    // Bounded lock free ring for many producers and one consumer - a sequence number in each cell says whose turn it is
+    // Producers claim a cell with one CAS on the tail and nobody ever takes a lock
+    template <typename T>
+    struct MpscRing
+    {
+        struct Cell
+        {
+            std::atomic<std::size_t>    sequence;
+            T                           value;
+        };
+        
+        std::vector<Cell>                       cells;
+        std::size_t                             mask;
+        alignas(64) std::atomic<std::size_t>    tail{};     // Next cell a producer claims
+        alignas(64) std::size_t                 head{};     // Next cell the consumer reads
+        
+        // Capacity is rounded up to a power of 2
+        explicit MpscRing( std::size_t capacity )
+            : cells( std::bit_ceil( std::max<std::size_t>( capacity, 2 ) ) ), mask( cells.size() - 1 )
+        {
+            for ( std::size_t i = 0; i < cells.size(); ++i )    cells[i].sequence.store( i, std::memory_order_relaxed );
+        }
+        
+        // Any thread - false if the ring is full, value is only moved from if we push it
+        bool TryPush( T& value )
+        {
+            std::size_t position = tail.load( std::memory_order_relaxed );
+            for (;;)
+            {
+                Cell& cell = cells[ position & mask ];
+                auto lag = (std::ptrdiff_t)cell.sequence.load( std::memory_order_acquire ) - (std::ptrdiff_t)position;
+                if ( lag < 0 )  return false;       // The consumer hasn't got this far round yet
+                if ( lag > 0 )
+                {
+                    position = tail.load( std::memory_order_relaxed );
+                    continue;
+                }
+                if ( !tail.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) )   continue;
+                
+                cell.value = std::move( value );
+                cell.sequence.store( position + 1, std::memory_order_release );
+                return true;
+            }
+        }
+        
+        // Consumer thread only
+        bool TryPop( T& value )
+        {
+            Cell& cell = cells[ head & mask ];
+            if ( cell.sequence.load( std::memory_order_acquire ) != head + 1 )  return false;
+            
+            value = std::move( cell.value );
+            cell.sequence.store( head + cells.size(), std::memory_order_release );
+            ++head;
+            return true;
+        }
+        
+        // Consumer thread only
+        bool Empty() const
+        {
+            return cells[ head & mask ].sequence.load( std::memory_order_acquire ) != head + 1;
+        }
+    };
+    
+    // Concurrent front end for MakeRisk - any number of threads submit risks and one applier thread puts them in the
+    // pool in batches, handing back the TxIds in the order it applied them. Only the applier touches the pool so
+    // while an intake is running everyone else goes through it
+    template <typename POOL>
+    struct RiskIntake
+    {
+        using Event     = POOL::Event;
+        using Amount    = POOL::Amount;
+        using TxId      = POOL::TxId;
+        using Callback  = std::function<void( TxId )>;
+        
+        static constexpr TxId None = -1;    // What a request gets instead of its id if the pool refused it or the journal couldn't make it durable
+        
+        struct Request
+        {
+            Event                               event;
+            Amount                              amount{};
+            std::string                         who;
+            std::optional< std::promise<TxId> > promise;    // One or the other
+            Callback                            done;
+        };
+        
+        // What we owe a request once its risk is in the pool, and durable if the pool has a journal
+        struct Ack
+        {
+            TxId                                id{};
+            std::optional< std::promise<TxId> > promise;
+            Callback                            done;
+        };
+        
+        POOL&                           pool;
+        MpscRing<Request>               ring;
+        std::size_t                     batch{ 4096 };      // Most we apply before we let anyone know
+        std::atomic<std::uint64_t>      submitted{};
+        std::atomic<std::uint64_t>      applied{};
+        std::atomic<std::uint32_t>      wakeups{};          // Bumped to wake the applier
+        std::atomic<bool>               sleeping{};
+        std::atomic<bool>               stop{};
+        std::function<void()>           after_batch;        // On the applier thread - eg SnapshotPublisher::Publish
+        std::thread                     applier;            // Last - it starts as soon as it is constructed
+        
+        explicit RiskIntake( POOL& pool, std::size_t capacity = std::size_t{1} << 16, std::function<void()> after_batch = {} )
+            : pool( pool ), ring( capacity ), after_batch( std::move( after_batch ) ), applier( [this]{ Apply(); } )
+        {
+        }
+        
+        // Applies whatever is left first
+        ~RiskIntake()
+        {
+            stop = true;
+            Wake();
+            applier.join();
+        }
+        
+        // The future holds None if the pool refused the risk, see Pool::MakeRisk, or if the pool's journal failed - then
+        // the risk is in the pool but would be lost in a crash
+        std::future<TxId> Submit( const Event& event, Amount amount, std::string who )
+        {
+            std::promise<TxId> promise;
+            auto future = promise.get_future();
+            Push( Request{ event, amount, std::move( who ), std::move( promise ), {} } );
+            return future;
+        }
+        
+        // Cheaper than a future - done( tx_id ) is called on the applier thread, or the journal's writer thread, so keep it short
+        // Ditto None if the pool refused it or the journal failed
+        void Submit( const Event& event, Amount amount, std::string who, Callback done )
+        {
+            Push( Request{ event, amount, std::move( who ), std::nullopt, std::move( done ) } );
+        }
+        
+        // Wait until everything submitted so far is in the pool
+        void Drain()
+        {
+            auto target = submitted.load();
+            for ( auto done = applied.load(); done < target; done = applied.load() )    applied.wait( done );
+        }
+        
+        void Push( Request&& request )
+        {
+            ++submitted;
+            while ( !ring.TryPush( request ) )  std::this_thread::yield();     // Full - let the applier catch up
+            
+            // Pairs with the fence in Apply - either we see it is asleep or it sees our request
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            if ( sleeping.load( std::memory_order_relaxed ) )   Wake();
+        }
+        
+        void Wake()
+        {
+            wakeups.fetch_add( 1 );
+            wakeups.notify_one();
+        }
+        
+        // If the pool has a journal each batch is committed and acknowledged once it is durable - with a background
+        // writer we carry on with the next batch while the last one is synced
+        void Apply()
+        {
+            Request request;
+            std::vector<Ack> acks;
+            for (;;)
+            {
+                std::uint64_t n = 0;
+                for ( ; n < batch && ring.TryPop( request ); ++n )
+                {
+                    TxId id = pool.MakeRisk( request.event, request.amount, request.who );
+                    acks.push_back( { id, std::move( request.promise ), std::move( request.done ) } );
+                    request.promise.reset();
+                }
+                if ( n > 0 )
+                {
+                    if ( pool.journal )
+                    {
+                        // The journal's callbacks must be copyable so the acks go in a shared_ptr
+                        auto batch_acks = std::make_shared< std::vector<Ack> >( std::move( acks ) );
+                        pool.journal->Commit( [batch_acks]( bool durable ){ Acknowledge( *batch_acks, durable ); } );
+                    }
+                    else    Acknowledge( acks, true );
+                    acks.clear();
+                    
+                    if ( after_batch )  after_batch();
+                    applied.fetch_add( n );
+                    applied.notify_all();
+                    continue;
+                }
+                if ( stop )     return;
+                
+                // Nothing to do - sleep until a producer wakes us
+                auto seen = wakeups.load();
+                sleeping = true;
+                std::atomic_thread_fence( std::memory_order_seq_cst );
+                if ( ring.Empty() && !stop )    wakeups.wait( seen );
+                sleeping = false;
+            }
+        }
+        
+        // Never hand out an id for a risk that didn't reach the disk - the journal's failure is sticky, so every
+        // batch after the first failed one gets None too
+        static void Acknowledge( std::vector<Ack>& acks, bool durable )
+        {
+            for (auto& ack : acks )
+            {
+                TxId id = durable ? ack.id : None;
+                if ( ack.promise )  ack.promise->set_value( id );
+                if ( ack.done )     ack.done( id );
+            }
+        }
+    };
+    
+    // Immutable snapshots of a pool's aggregates for the quotes - the writer publishes a new one after each batch of
+    // risks and readers pin the current one without taking a lock, so quotes and intake never wait on each other
+    // Epoch based reclamation - a reader pins the epoch it started in, a snapshot retired in epoch e is freed once
+    // every pinned reader is past e
+    template <typename POOL>
+    struct SnapshotPublisher
+    {
+        static constexpr std::size_t MaxReaders = 64;
+        
+        struct alignas(64) Slot
+        {
+            std::atomic<std::uint64_t>  pinned{};       // Epoch the reader is in, 0 if it isn't reading
+            std::atomic<bool>           taken{};
+        };
+        
+        // A pinned snapshot - valid until it goes out of scope
+        struct Snapshot
+        {
+            Slot*       slot;
+            const POOL* pool;
+            
+            Snapshot( Slot* slot, const POOL* pool ) : slot( slot ), pool( pool ) {}
+            Snapshot( const Snapshot& ) = delete;
+            Snapshot& operator=( const Snapshot& ) = delete;
+            ~Snapshot()
+            {
+                slot->pinned.store( 0, std::memory_order_release );
+            }
+            
+            const POOL* operator->() const  { return pool; }
+            const POOL& operator*() const   { return *pool; }
+        };
+        
+        // One per reader thread - holds a slot for as long as it lives, one Pin() at a time
+        struct Reader
+        {
+            SnapshotPublisher&  publisher;
+            Slot*               slot{};
+            
+            // Waits for a slot if all MaxReaders are taken - so don't hold more than one per thread
+            explicit Reader( SnapshotPublisher& publisher ) : publisher( publisher )
+            {
+                for (;;)
+                {
+                    for (auto& candidate : publisher.slots )
+                        if ( !candidate.taken.exchange( true ) )
+                        {
+                            slot = &candidate;
+                            return;
+                        }
+                    std::this_thread::yield();
+                }
+            }
+            Reader( const Reader& ) = delete;
+            Reader& operator=( const Reader& ) = delete;
+            ~Reader()
+            {
+                if ( slot )     slot->taken.store( false );
+            }
+            
+            Snapshot Pin()
+            {
+                slot->pinned.store( publisher.epoch.load() );
+                return { slot, publisher.current.load() };
+            }
+        };
+        
+        const POOL&                 pool;                   // Only Publish reads it, on the writer thread
+        std::atomic<const POOL*>    current;
+        std::atomic<std::uint64_t>  epoch{1};
+        std::array<Slot,MaxReaders> slots;
+        std::vector< std::pair< const POOL*, std::uint64_t > > retired;    // Writer only - snapshot and its last epoch
+        
+        explicit SnapshotPublisher( const POOL& pool ) : pool( pool ), current( new POOL( pool.MakeSnapshot() ) ) {}
+        SnapshotPublisher( const SnapshotPublisher& ) = delete;
+        SnapshotPublisher& operator=( const SnapshotPublisher& ) = delete;
+        
+        // No readers left by now
+        ~SnapshotPublisher()
+        {
+            delete current.load();
+            for (auto& [snapshot,retired_epoch] : retired )     delete snapshot;
+        }
+        
+        // Writer thread - swap in a copy of the aggregates as they are now
+        // A reader that loaded the old snapshot pinned an epoch no later than the one we retire it in
+        void Publish()
+        {
+            const POOL* old = current.exchange( new POOL( pool.MakeSnapshot() ) );
+            retired.emplace_back( old, epoch.fetch_add( 1 ) );
+            Reclaim();
+        }
+        
+        void Reclaim()
+        {
+            std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+            for (const auto& slot : slots )
+                if ( auto pinned = slot.pinned.load(); pinned != 0 )     oldest = std::min( oldest, pinned );
+            
+            std::erase_if( retired, [&]( const auto& entry ) {
+                if ( entry.second >= oldest )   return false;
+                delete entry.first;
+                return true;
+            } );
+        }
+    };
+    
+    // A pool split into shards, each an ordinary pool of its own - risks go to a shard by the hash of the account
+    // All the aggregates add up across shards, so summing the shards' running totals gives exact global settlement
+    // and quotes. Each shard can take its own RiskIntake and settle its own chunks so intake and settlement spread
+    // over the cores, route with ShardOf
+    // Global TxIds interleave the shards' own - local * shards + shard. So do the AccountIds in the risks we hand back,
+    // as each shard interns its own accounts - the pool's own accounts come out once per shard
+    template <typename POOL>
+    struct ShardedPool
+    {
+        using Event     = POOL::Event;
+        using Risk      = POOL::Risk;
+        using Amount    = POOL::Amount;
+        using Level     = POOL::Level;
+        using TxId      = POOL::TxId;
+        using AccountId = POOL::AccountId;
+        
+        std::vector<POOL> shards;
+        
+        explicit ShardedPool( std::size_t n = std::max( 1u, std::thread::hardware_concurrency() ) ) : shards( n ) {}
+        
+        std::size_t ShardOf( const std::string& who ) const
+        {
+            return std::hash<std::string>{}( who ) % shards.size();
+        }
+        
+        static constexpr TxId None = -1;
+        
+        // In 64 bits - None if it doesn't fit in a TxId
+        TxId ToGlobal( std::size_t shard, TxId local ) const
+        {
+            std::int64_t id = (std::int64_t)local * (std::int64_t)shards.size() + (std::int64_t)shard;
+            return id <= std::numeric_limits<TxId>::max() ? (TxId)id : None;
+        }
+        
+        // id must not be negative
+        std::pair< std::size_t, TxId > ToLocal( TxId id ) const
+        {
+            assert( id >= 0 );
+            return { (std::size_t)id % shards.size(), (TxId)( (std::size_t)id / shards.size() ) };
+        }
+        
+        // A shard's account as we hand it out - InternTable::None if it doesn't fit in an AccountId
+        AccountId ToGlobalAccount( std::size_t shard, AccountId local ) const
+        {
+            std::int64_t id = (std::int64_t)local * (std::int64_t)shards.size() + (std::int64_t)shard;
+            return local >= 0 && id <= std::numeric_limits<AccountId>::max() ? (AccountId)id : InternTable::None;
+        }
+        
+        // Name of an account in the risks we hand back
+        const std::string& AccountName( AccountId id ) const
+        {
+            assert( id >= 0 );
+            return shards[ (std::size_t)id % shards.size() ].AccountName( (AccountId)( (std::size_t)id / shards.size() ) );
+        }
+        
+        // A shard's risk with the global TxId and account
+        Risk ToGlobal( std::size_t shard, Risk risk ) const
+        {
+            risk.tx.id = ToGlobal( shard, risk.tx.id );
+            risk.tx.client_account = ToGlobalAccount( shard, risk.tx.client_account );
+            return risk;
+        }
+        
+        // None, and the risk isn't made, once the shard's next id has no global TxId or the stake doesn't Fit the
+        // whole pool - O(shards) to add it up. A RiskIntake on a shard only checks the shard's own total
+        TxId MakeRisk( const Event& event, Amount amount, const std::string& who )
+        {
+            std::size_t shard = ShardOf( who );
+            if ( ToGlobal( shard, shards[shard].tx ) == None || !POOL::Fits( TotalPool(), amount ) )  return None;
+            return ToGlobal( shard, shards[shard].MakeRisk( event, amount, who ) );
+        }
+        
+        void CancelRisk( TxId id )
+        {
+            if ( id < 0 )   return;
+            auto [shard,local] = ToLocal( id );
+            shards[shard].CancelRisk( local );
+        }
+        
+        Risk GetRisk( TxId id ) const
+        {
+            if ( id < 0 )   return Risk{};
+            auto [shard,local] = ToLocal( id );
+            if ( local >= shards[shard].tx )    return Risk{};
+            return ToGlobal( shard, shards[shard].GetRisk( local ) );
+        }
+        
+        // Every shard has the same fees, we take them from the first
+        Amount Fees( Amount total ) const
+        {
+            return shards.front().Fees( total );
+        }
+        
+        Amount TotalPool() const
+        {
+            Amount result{};
+            for (const auto& shard : shards )   result += shard.TotalPool();
+            return result;
+        }
+        
+        Amount TotalWinningAmount( Level level ) const
+        {
+            Amount result{};
+            for (const auto& shard : shards )   result += shard.TotalWinningAmount( level );
+            return result;
+        }
+        
+        // Pool, winning amount and weight totals over all the shards
+        SettlementTotals MakeTotals( Level level ) const
+        {
+            SettlementTotals totals;
+            for (const auto& shard : shards )
+                totals += { shard.TotalPool(), shard.TotalWinningAmount( level ), shard.TotalWinningWeight( level ) };
+            return totals;
+        }
+        
+        std::map< std::string, double > CategoryMap() const
+        {
+            std::map< std::string, double > result;
+            for (const auto& shard : shards )
+                for (const auto& [category,amount] : shard.CategoryMap() )    result[ category ] += amount;
+            return result;
+        }
+        
+        // Union of the shards' levels - then the one tick under/over the whole lot as Pool::MakeLevelSet does
+        std::set<Level> MakeLevelSet() const
+        {
+            std::set<Level> levels;
+            for (const auto& shard : shards )
+                for (const auto& [key,amount] : shard.level_stake )   levels.insert( shard.ToLevel( key ) );
+            
+            if constexpr ( std::is_arithmetic_v<Level> )
+            {
+                if ( levels.empty() )   return levels;
+                auto min = *levels.begin();
+                auto max = *levels.rbegin();
+                levels.insert( min-1 );
+                levels.insert( max+1 );
+            }
+            return levels;
+        }
+        
+        // Each shard's Settlement with the global totals - they only differ in the pool they look the risks up in
+        // As with Pool::Settlement leave the shards alone while you use it - a risk made since is a bust
+        struct Settlement
+        {
+            const ShardedPool*                      pool{};
+            std::vector< typename POOL::Settlement > shards;
+            
+            bool IsWinner( TxId id ) const
+            {
+                if ( id < 0 )   return false;
+                auto [shard,local] = pool->ToLocal( id );
+                return shards[shard].IsWinner( local );
+            }
+            
+            Amount Payout( TxId id ) const
+            {
+                if ( id < 0 )   return 0;
+                auto [shard,local] = pool->ToLocal( id );
+                return shards[shard].Payout( local );
+            }
+            
+            Risk GetRisk( TxId id ) const
+            {
+                if ( id < 0 )   return Risk{};
+                auto [shard,local] = pool->ToLocal( id );
+                if ( !shards[shard].IsWinner( local ) )     return Risk{};
+                return pool->ToGlobal( shard, shards[shard].GetRisk( local ) );
+            }
+        };
+        
+        Settlement Settle( Level level ) const
+        {
+            auto totals = MakeTotals( level );
+            Settlement settlement{ this, {} };
+            for (const auto& shard : shards )     settlement.shards.push_back( shard.Settle( level, totals ) );
+            return settlement;
+        }
+        
+        // Every shard collects its own winners, chunk by chunk across the threads, against the global totals
+        std::map< TxId, Risk > MakeWinningRisks( Level level ) const
+        {
+            auto settlement = Settle( level );
+            std::map< TxId, Risk > winning_risks;
+            for ( std::size_t s = 0; s < shards.size(); ++s )
+            {
+                const auto& shard_settlement = settlement.shards[s];
+                auto winners = shards[s].CollectWinners( shard_settlement, [&]( TxId local ){ return shard_settlement.Weight( local ); }, []( const Risk& ){} );
+                for (auto& [local,risk] : winners )
+                {
+                    TxId id = ToGlobal( s, local );
+                    winning_risks.emplace( id, ToGlobal( s, std::move( risk ) ) );
+                }
+            }
+            return winning_risks;
+        }
+        
+        // Quotes - the shard MakeRisk would put the hypothetical risk in does the arithmetic with the global totals,
+        // so the risk has the global TxId and account MakeRisk would give it
+        Risk ProFormaReturn( const Event& event, Amount amount, Level level ) const
+        {
+            std::size_t shard = ShardOf( "Hypothetical" );
+            Risk risk = shards[shard].MakeHypotheticalRisk( event, amount );
+            auto totals = MakeTotals( level );
+            if ( !risk.IsWinner( level ) || !POOL::Fits( totals.pool, amount ) )  return Risk{};  // Its a bust
+            
+            shards[shard].MakeProFormaRisk( risk, level, totals );
+            return ToGlobal( shard, risk );
+        }
+        
+        std::map< Level, double > ProFormaPayoffCurve( const Event& event, Amount amount ) const
+        {
+            std::map< Level, double > result;
+            for (const auto& level : MakeLevelSet() )   result[ level ] = ProFormaReturn( event, amount, level ).payoff;
+            return result;
+        }
+    };
+};
+
+int main(int, const char *[]) {
+    
+    using namespace tp;
+    
+    MutexPool mutex_pool;
     mutex_pool.MakeRisk( MutexPool::Event{"default"},    500,    "barney" );
     mutex_pool.MakeRisk( MutexPool::Event{"default"},    2500,   "barney" );
     mutex_pool.MakeRisk( MutexPool::Event{"no_default"}, 10000,  "arnold"    );
     mutex_pool.MakeRisk( MutexPool::Event{"no_default"}, 5000,   "arnold"    );
     
     auto mutex_levels = mutex_pool.MakeLevelSet();
-    auto mutex_total_pool = mutex_pool.TotalPool();
-    auto mutex_total_winnning_amount = mutex_pool.TotalWinningAmount( "default" );
+    [[maybe_unused]] auto mutex_total_pool = mutex_pool.TotalPool();
+    [[maybe_unused]] auto mutex_total_winnning_amount = mutex_pool.TotalWinningAmount( "default" );
     
     std::cout << mutex_pool.CategoryMap() << std::endl;
-    mutex_pool.MakeWinningRisks("default");
+    TextReportSink< MutexPool::Risk > mutex_report;
+    mutex_pool.MakeWinningRisks( "default", mutex_report );
+    mutex_report.Flush( std::cout );
     auto mutex_pro_forma = mutex_pool.ProFormaReturnHelper( MutexPool::Event{"default"}, 1000, "default" );
     
+    // Quotes off a const snapshot match the pool's
+    [[maybe_unused]] const auto mutex_snapshot = mutex_pool.MakeSnapshot();
+    assert( mutex_snapshot.ProFormaPayoffCurve( MutexPool::Event{"default"}, 1000 ) == mutex_pool.ProFormaPayoffCurve( MutexPool::Event{"default"}, 1000 ) );
+    
     LongShortPool ls_pool;
     ls_pool.MakeRisk( LongShortPool::Event{ Side::Long, 50}, 500, "barney" );
     ls_pool.MakeRisk( LongShortPool::Event{ Side::Long, 55}, 250, "barney");
@@ -503,20 +3757,443 @@ int main(int argc, const char * argv[]) {
     ls_pool.MakeRisk( LongShortPool::Event{ Side::Short, 40}, 1500, "arnold");
     
     auto ls_levels = ls_pool.MakeLevelSet();
-    auto ls_total_pool = ls_pool.TotalPool();
-    auto ls_total_winnning_amount = ls_pool.TotalWinningAmount( 56 );
+    [[maybe_unused]] auto ls_total_pool = ls_pool.TotalPool();
+    [[maybe_unused]] auto ls_total_winnning_amount = ls_pool.TotalWinningAmount( 56 );
     
     std::cout << ls_pool.CategoryMap() << std::endl;
-    ls_pool.MakeWinningRisks(56);
+    TextReportSink< LongShortPool::Risk > ls_report;
+    ls_pool.MakeWinningRisks( 56, ls_report );
+    ls_report.Flush( std::cout );
+    
+    // The binary report reads back as the winners then the totals the settlement reported
+    [[maybe_unused]] auto binary_report_round_trip = [&]{
+        BinaryReportSink< LongShortPool::Risk > report;
+        auto winners = ls_pool.MakeWinningRisks( 56, report );
+        
+        std::size_t at = 0;
+        auto get = [&]( auto& value ) {
+            if ( at + sizeof( value ) > report.buffer.size() )     return false;
+            std::memcpy( &value, report.buffer.data() + at, sizeof( value ) );
+            at += sizeof( value );
+            return true;
+        };
+        auto winner = winners.begin();
+        std::map< ReportField, std::int64_t > totals;
+        for ( ReportField field; at < report.buffer.size(); )
+        {
+            std::int64_t id, amount, payout;
+            if ( !get( field ) )    return false;
+            if ( field != ReportField::Winner )
+            {
+                if ( !get( totals[ field ] ) )  return false;
+                continue;
+            }
+            if ( !get( id ) || !get( amount ) || !get( payout ) || winner == winners.end()
+                || id != winner->first || amount != winner->second.tx.amount || payout != winner->second.tx.payout )    return false;
+            ++winner;
+        }
+        auto settlement = ls_pool.Settle( 56 );
+        return winner == winners.end() && totals[ ReportField::ClosingPrice ] == 56 && totals[ ReportField::Fees ] == settlement.fees
+            && totals[ ReportField::PoolValue ] == ls_pool.TotalPool() && totals[ ReportField::Dust ] == settlement.total_pool_value - totals[ ReportField::TotalPayout ];
+    };
+    assert( binary_report_round_trip() );
+    
+    // A tx the pool never made is a bust, not a read past the columns
+    [[maybe_unused]] auto ls_settlement = ls_pool.Settle( 56 );
+    assert( ls_settlement.Payout( ls_pool.tx ) == 0 && !ls_settlement.IsWinner( -1 ) && ls_pool.GetRisk( ls_pool.tx ).tx.amount == 0 );
+    
+    // Nor is a risk made after we settled - the pot doesn't have its stake
+    [[maybe_unused]] auto settled_before = [&]{
+        LongShortPool pool( ls_pool );
+        auto settlement = pool.Settle( 56 );
+        auto id = pool.MakeRisk( LongShortPool::Event{ Side::Long, 55 }, 1, "barney" );
+        LongShortPool::Amount paid{};
+        for ( LongShortPool::TxId i = 0; i < pool.tx; ++i )   paid += settlement.Payout( i );
+        return settlement.Payout( id ) == 0 && paid <= settlement.total_pool_value;
+    };
+    assert( settled_before() );
+    
+    // A stake that would overflow the running totals isn't taken one at a time, in bulk or from CSV, nor quoted
+    [[maybe_unused]] auto overflow_refused = []{
+        LongShortPool pool;
+        auto max = std::numeric_limits<LongShortPool::Amount>::max();
+        LongShortPool::Event event{ Side::Short, 60 };
+        bool ok = pool.MakeRisk( LongShortPool::Event{ Side::Long, 50 }, max - 10, "barney" ) == 0;
+        ok = ok && pool.MakeRisk( event, 11, "arnold" ) == LongShortPool::None && pool.MakeRisk( event, -1, "arnold" ) == LongShortPool::None;
+        LongShortPool::BulkRisk row{ Side::Short, 60, 11, pool.accounts.Intern( "arnold" ) };
+        ok = ok && pool.MakeRisks( std::span( &row, 1 ) ) == LongShortPool::None && pool.LoadCsv( "Short,60,11,arnold" ) == 0;
+        ok = ok && pool.ProFormaReturn( event, 11, 55 ).tx.amount == 0 && pool.ProFormaReturn( event, 10, 55 ).tx.amount == 10;
+        return ok && pool.tx == 1 && pool.TotalPool() == max - 10;
+    };
+    assert( overflow_refused() );
     
     auto ls_curve = ls_pool.ProFormaPayoffCurve( LongShortPool::Event{ Side::Long,  50}, 500 );
     
     // Don't mutate the pool
-    auto ls_pro_forma_long  = ls_pool.ProFormaReturn( LongShortPool::Event{ Side::Long,  50}, 1000, 51 );
-    auto ls_pro_forma_short = ls_pool.ProFormaReturn( LongShortPool::Event{ Side::Short, 50}, 1000, 49 );
+    [[maybe_unused]] auto ls_pro_forma_long  = ls_pool.ProFormaReturn( LongShortPool::Event{ Side::Long,  50}, 1000, 51 );
+    [[maybe_unused]] auto ls_pro_forma_short = ls_pool.ProFormaReturn( LongShortPool::Event{ Side::Short, 50}, 1000, 49 );
+    
+    // The helper mutates the pool so each check gets its own copy
+    [[maybe_unused]] auto ls_pro_forma_long_check  = LongShortPool( ls_pool ).ProFormaReturnHelper( LongShortPool::Event{ Side::Long,  50}, 1000, 51 );
+    [[maybe_unused]] auto ls_pro_forma_short_check = LongShortPool( ls_pool ).ProFormaReturnHelper( LongShortPool::Event{ Side::Short, 50}, 1000, 49 );
+    assert( ls_pro_forma_long.tx.payout == ls_pro_forma_long_check.tx.payout );
+    assert( ls_pro_forma_short.tx.payout == ls_pro_forma_short_check.tx.payout );
+    
+    // The inverse distance curve is exact - 200 prices over 121 levels is enough for it to take the FFTs rather than
+    // go level by level
+    [[maybe_unused]] auto inverse_distance_curve_exact = []{
+        LongShortPool pool;
+        for ( LongShortPool::Level price = 1000; price < 1100; ++price )
+            for ( int i = 0; i <= price % 3; ++i )
+            {
+                pool.MakeRisk( LongShortPool::Event{ Side::Long, price }, 100, "barney" );
+                pool.MakeRisk( LongShortPool::Event{ Side::Short, price + 5 }, 100, "arnold" );
+            }
+        
+        auto curve = pool.MakeInverseDistanceCurve( 990, 1110 );
+        for ( LongShortPool::Level level = 990; level <= 1110; ++level )
+            if ( curve[ level - 990 ] != pool.TotalWinningInverseDistance( level ) )     return false;
+        return true;
+    };
+    assert( inverse_distance_curve_exact() );
+    
+    // The vector kernels give the scalar one's weights and totals - enough risks for the AVX-512 loop, an odd tail
+    // and some cancelled, and AVX2 checked directly as Settle only picks it when there is no AVX-512
+    // Then prices and levels far enough apart that their distance doesn't fit in 32 bits - each weight is the risk's own
+    [[maybe_unused]] auto kernel_matches_scalar = []{
+        LongShortPool pool;
+        for ( LongShortPool::TxId id = 0; id < 101; ++id )
+            pool.MakeRisk( LongShortPool::Event{ id % 2 ? Side::Short : Side::Long, 40 + id * 7 % 31 }, 100 + id, "barney" );
+        for ( LongShortPool::TxId id = 0; id < 101; id += 9 )     pool.CancelRisk( id );
+        
+        std::vector<LongShortPool::Level> levels;
+        for ( LongShortPool::Level level = 38; level <= 72; ++level )   levels.push_back( level );
+        constexpr auto lowest = std::numeric_limits<LongShortPool::Level>::min() + 1, highest = std::numeric_limits<LongShortPool::Level>::max() - 1;
+        for ( auto price : { lowest, highest, -2000000000, 2000000000, 0 } )
+        {
+            levels.push_back( price );
+            for ( auto side : { Side::Long, Side::Short } )     pool.MakeRisk( LongShortPool::Event{ side, price }, 1000, "arnold" );
+        }
+        
+        auto columns = pool.MakeColumns( 0, pool.tx );
+        auto same = []( const SettlementTotals& a, const SettlementTotals& b ) {
+            return a.pool == b.pool && a.win == b.win && a.weight == b.weight;
+        };
+        for ( auto level : levels )
+        {
+            std::vector<std::int64_t> scalar( pool.tx ), vector( pool.tx );
+            SettlementTotals expected;
+            LongShortKernel::SweepScalar( columns, level, 0, columns.n, scalar.data(), expected );
+            for ( LongShortPool::TxId id = 0; id < pool.tx; ++id )
+                if ( scalar[id] != ( pool.risks.live[id] ? LongShortPool::Event::InverseDistanceWeight( pool.risks.side[id], pool.risks.level[id], level ) : 0 ) )
+                    return false;
+            if ( !same( LongShortKernel::Settle( columns, level, vector.data() ), expected ) || vector != scalar )     return false;
+#if defined(__x86_64__) && ( defined(__GNUC__) || defined(__clang__) )
+            if ( __builtin_cpu_supports( "avx2" ) )
+            {
+                SettlementTotals avx2;
+                LongShortKernel::SweepAVX2( columns, level, vector.data(), avx2 );
+                if ( !same( avx2, expected ) || vector != scalar )   return false;
+            }
+#endif
+        }
+        return true;
+    };
+    assert( kernel_matches_scalar() );
+    
+    // Each quote in a batch is ProFormaReturn for its stake and level
+    [[maybe_unused]] auto batch_matches = []( const auto& pool, const auto& events ) {
+        using P = std::remove_cvref_t< decltype( pool ) >;
+        std::vector< typename P::Quote > quotes;
+        for (const auto& event : events )
+            for ( typename P::Amount amount : { 1, 1000, 50000 } )
+                for (const auto& level : pool.MakeLevelSet() )    quotes.push_back( { event, amount, level } );
+        
+        std::vector< typename P::Risk > results( quotes.size() );
+        pool.ProFormaReturnBatch( quotes, results );
+        for ( std::size_t i = 0; i < quotes.size(); ++i )
+        {
+            auto expected = pool.ProFormaReturn( quotes[i].event, quotes[i].amount, quotes[i].level );
+            if ( results[i].tx.id != expected.tx.id || results[i].tx.payout != expected.tx.payout || results[i].payoff != expected.payoff )
+                return false;
+        }
+        return true;
+    };
+    assert( batch_matches( mutex_pool, std::vector{ MutexPool::Event{"default"}, MutexPool::Event{"no_default"} } ) );
+    assert( batch_matches( ls_pool, std::vector{ LongShortPool::Event{ Side::Long, 50 }, LongShortPool::Event{ Side::Short, 55 } } ) );
+    
+    // Each cell of a payoff surface is ProFormaReturn's payoff for its stake and level, busts and all
+    [[maybe_unused]] auto surface_matches = []( const auto& pool, const auto& event ) {
+        using P = std::remove_cvref_t< decltype( pool ) >;
+        std::vector< typename P::Amount > amounts{ 1, 250, 1000, 50000 };
+        auto surface = pool.MakePayoffSurface( event, amounts );
+        if ( surface.levels.size() != pool.MakeLevelSet().size() )   return false;
+        for ( std::size_t row = 0; row < surface.levels.size(); ++row )
+            for ( std::size_t column = 0; column < amounts.size(); ++column )
+                if ( surface( row, column ) != pool.ProFormaReturn( event, amounts[column], surface.levels[row] ).payoff )    return false;
+        return true;
+    };
+    assert( surface_matches( mutex_pool, MutexPool::Event{"no_default"} ) );
+    assert( surface_matches( ls_pool, LongShortPool::Event{ Side::Long, 50 } ) );
+    assert( surface_matches( ls_pool, LongShortPool::Event{ Side::Short, 55 } ) );
+    
+    // The scheduler settles both pools at every level to Settle's totals - chunks of 2 risks so the pools are split
+    // and the last chunk in does the merge
+    [[maybe_unused]] auto scheduled_matches = [&]{
+        SettlementScheduler scheduler;
+        scheduler.chunk = 2;
+        std::vector<MutexPool::Settlement> mutex_results( mutex_levels.size() );
+        std::vector<LongShortPool::Settlement> ls_results( ls_levels.size() );
+        std::size_t i = 0;
+        for (const auto& level : mutex_levels )     scheduler.Add( mutex_pool, level, mutex_results[ i++ ] );
+        i = 0;
+        for (const auto& level : ls_levels )        scheduler.Add( ls_pool, level, ls_results[ i++ ] );
+        scheduler.Run();
+        
+        auto same = []( const auto& pool, const auto& results, const auto& levels ) {
+            std::size_t i = 0;
+            for (const auto& level : levels )
+            {
+                const auto& result = results[ i++ ];
+                auto expected = pool.Settle( level );
+                if ( result.pool != &pool || result.level != level || result.fees != expected.fees || result.total_pool_value != expected.total_pool_value
+                    || result.total_win_value != expected.total_win_value || result.total_weight != expected.total_weight )    return false;
+            }
+            return true;
+        };
+        return same( mutex_pool, mutex_results, mutex_levels ) && same( ls_pool, ls_results, ls_levels );
+    };
+    assert( scheduled_matches() );
+    
+    // Same risks, same totals and the same winners paid the same at every level
+    [[maybe_unused]] auto same_pool = []( const auto& a, const auto& b ) {
+        if ( a.tx != b.tx || a.TotalPool() != b.TotalPool() || a.CategoryMap() != b.CategoryMap() || a.MakeLevelSet() != b.MakeLevelSet() )
+            return false;
+        for (const auto& level : a.MakeLevelSet() )
+        {
+            auto winners = a.MakeWinningRisks( level ), others = b.MakeWinningRisks( level );
+            if ( winners.size() != others.size() )  return false;
+            for (const auto& [id,risk] : winners )
+            {
+                auto other = others.find( id );
+                if ( other == others.end() || other->second.tx.payout != risk.tx.payout
+                    || a.AccountName( risk.tx.client_account ) != b.AccountName( other->second.tx.client_account ) )    return false;
+            }
+        }
+        return true;
+    };
+    
+    // Sharded winners are paid and named as the single pool's, with the accounts spread over the shards
+    [[maybe_unused]] auto sharded_matches = [&]{
+        LongShortPool single;
+        ShardedPool< LongShortPool > sharded( 4 );
+        for ( LongShortPool::TxId id = 0; id < ls_pool.tx; ++id )
+        {
+            LongShortPool::Event event{ ls_pool.risks.side[id], ls_pool.risks.level[id] };
+            auto who = ls_pool.AccountName( ls_pool.risks.account[id] ) + std::to_string( id );
+            single.MakeRisk( event, ls_pool.risks.amount[id], who );
+            sharded.MakeRisk( event, ls_pool.risks.amount[id], who );
+        }
+        for (const auto& level : single.MakeLevelSet() )
+        {
+            std::vector< std::tuple< std::string, LongShortPool::Amount, LongShortPool::Amount > > expected, got;
+            for (const auto& [id,risk] : single.MakeWinningRisks( level ) )    expected.emplace_back( single.AccountName( risk.tx.client_account ), risk.tx.amount, risk.tx.payout );
+            for (const auto& [id,risk] : sharded.MakeWinningRisks( level ) )   got.emplace_back( sharded.AccountName( risk.tx.client_account ), risk.tx.amount, risk.tx.payout );
+            std::sort( expected.begin(), expected.end() );
+            std::sort( got.begin(), got.end() );
+            if ( expected != got )  return false;
+        }
+        
+        // A quote's risk is the one MakeRisk would make, not someone else's
+        auto quote = sharded.ProFormaReturn( LongShortPool::Event{ Side::Long, 50 }, 1000, 51 );
+        return quote.tx.payout == single.ProFormaReturn( LongShortPool::Event{ Side::Long, 50 }, 1000, 51 ).tx.payout
+            && quote.tx.id == sharded.MakeRisk( LongShortPool::Event{ Side::Long, 50 }, 1000, "Hypothetical" )
+            && sharded.AccountName( quote.tx.client_account ) == "Hypothetical";
+    };
+    assert( sharded_matches() );
+    
+    // Two threads submitting through an intake at once give the pool we get making the risks one at a time in the
+    // order the intake handed out their TxIds - a small ring so the producers fill it and wait on the applier
+    [[maybe_unused]] auto intake_matches = [&]{
+        using TxId = LongShortPool::TxId;
+        struct Submitted
+        {
+            LongShortPool::Event        event;
+            LongShortPool::Amount       amount{};
+            std::string                 who;
+            std::future<TxId>           id;
+        };
+        
+        LongShortPool concurrent, sequential;
+        std::vector<Submitted> submitted( 64 * (std::size_t)ls_pool.tx );
+        {
+            RiskIntake<LongShortPool> intake( concurrent, 8 );
+            auto produce = [&]( std::size_t first ) {
+                for ( std::size_t i = first; i < submitted.size(); i += 2 )
+                {
+                    TxId id = (TxId)( i % (std::size_t)ls_pool.tx );
+                    auto& request = submitted[i];
+                    request.event = LongShortPool::Event{ ls_pool.risks.side[id], ls_pool.risks.level[id] };
+                    request.amount = ls_pool.risks.amount[id];
+                    request.who = ls_pool.AccountName( ls_pool.risks.account[id] ) + std::to_string( i );
+                    request.id = intake.Submit( request.event, request.amount, request.who );
+                }
+            };
+            std::thread other( produce, 1 );
+            produce( 0 );
+            other.join();
+            intake.Drain();
+        }
+        
+        std::vector<const Submitted*> by_id( submitted.size() );
+        for (auto& request : submitted )
+        {
+            TxId id = request.id.get();
+            if ( id < 0 || (std::size_t)id >= by_id.size() || by_id[id] )     return false;
+            by_id[id] = &request;
+        }
+        for (const auto* request : by_id )    sequential.MakeRisk( request->event, request->amount, request->who );
+        return same_pool( concurrent, sequential );
+    };
+    assert( intake_matches() );
+    
+    // A reader pinned after Publish() quotes what the live pool quotes - the risks made since the last one included
+    [[maybe_unused]] auto published_matches = [&]{
+        LongShortPool pool( ls_pool );
+        SnapshotPublisher<LongShortPool> publisher( pool );
+        SnapshotPublisher<LongShortPool>::Reader reader( publisher );
+        pool.MakeRisk( LongShortPool::Event{ Side::Long, 45 }, 800, "barney" );
+        pool.CancelRisk( 2 );
+        publisher.Publish();
+        
+        auto snapshot = reader.Pin();
+        if ( snapshot->CategoryMap() != pool.CategoryMap() )   return false;
+        for (const auto& event : { LongShortPool::Event{ Side::Long, 50 }, LongShortPool::Event{ Side::Short, 55 } } )
+            for (const auto& level : pool.MakeLevelSet() )
+            {
+                auto quote = snapshot->ProFormaReturn( event, 1000, level ), expected = pool.ProFormaReturn( event, 1000, level );
+                if ( quote.tx.payout != expected.tx.payout || quote.payoff != expected.payoff )    return false;
+            }
+        return true;
+    };
+    assert( published_matches() );
+    
+    // The files round trip - the checks write to the temp directory and clean up after themselves
+    [[maybe_unused]] auto temp = ( std::filesystem::temp_directory_path() / ( "trust_pooler_" + std::to_string( ::getpid() ) ) ).string();
+    
+    // The exported payouts are MakeWinningRisks
+    [[maybe_unused]] auto payouts_round_trip = [&]( const auto& pool, auto level ) {
+        using P = std::remove_cvref_t< decltype( pool ) >;
+        auto path = temp + ".payouts";
+        SnapshotFile file;
+        auto settlement = pool.Settle( level );
+        bool ok = pool.ExportPayouts( settlement, path.c_str() ) && file.Map( path.c_str(), SnapshotFile::Payouts );
+        std::remove( path.c_str() );
+        ok = ok && file.header.paid_out + file.header.dust == settlement.total_pool_value && file.header.total_stake == pool.total_stake;
+        auto ids = file.Get< typename P::TxId >();
+        auto accounts = file.Get< typename P::AccountId >();
+        auto payouts = file.Get< typename P::Amount >();
+        auto winners = pool.MakeWinningRisks( level );
+        ok = ok && !file.bad && ids.size() == winners.size() && file.header.paid_out == std::accumulate( payouts.begin(), payouts.end(), typename P::Amount{} );
+        std::size_t i = 0;
+        for (const auto& [id,risk] : winners )
+        {
+            ok = ok && ids[i] == id && accounts[i] == risk.tx.client_account && payouts[i] == risk.tx.payout;
+            ++i;
+        }
+        return ok;
+    };
+    assert( payouts_round_trip( mutex_pool, MutexPool::Level{"default"} ) );
+    assert( payouts_round_trip( ls_pool, 56 ) );
+    
+    // Replaying the journal gives back the pool that wrote it, cancels included - a scratch copy of the pool doesn't
+    // write to it, and the other kind of pool won't read it or open it over the top
+    [[maybe_unused]] auto journal_round_trip = [&]{
+        auto path = temp + ".journal";
+        LongShortPool journaled, recovered, again;
+        MutexPool wrong_kind;
+        Journal journal, reopened;
+        bool ok = journal.Open( path.c_str(), LongShortPool::PoolKind );
+        journaled.journal = &journal;
+        for ( LongShortPool::TxId id = 0; id < ls_pool.tx; ++id )
+            journaled.MakeRisk( LongShortPool::Event{ ls_pool.risks.side[id], ls_pool.risks.level[id] }, ls_pool.risks.amount[id], ls_pool.AccountName( ls_pool.risks.account[id] ) );
+        journaled.CancelRisk( 1 );
+        LongShortPool( journaled ).ProFormaReturnHelper( LongShortPool::Event{ Side::Long, 50 }, 1000, 51 );
+        ok = journal.Close() && ok;
+        ok = recovered.Recover( path.c_str() ) > 0 && ok;
+        ok = wrong_kind.Recover( path.c_str() ) == Journal::Unreadable && wrong_kind.tx == 0 && ok;
+        ok = !reopened.Open( path.c_str(), MutexPool::PoolKind, wrong_kind.Recover( path.c_str() ) ) && ok;
+        ok = again.Recover( path.c_str() ) > 0 && ok;
+        std::remove( path.c_str() );
+        return ok && same_pool( journaled, recovered ) && same_pool( journaled, again );
+    };
+    assert( journal_round_trip() );
+    
+    // Snapshots map back to the pool that wrote them
+    [[maybe_unused]] auto snapshot_round_trip = [&]( const auto& pool ) {
+        auto path = temp + ".snapshot";
+        std::remove_cvref_t< decltype( pool ) > mapped;
+        bool ok = pool.WriteSnapshotFile( path.c_str() ) && mapped.MapSnapshotFile( path.c_str() );
+        std::remove( path.c_str() );
+        return ok && same_pool( pool, mapped );
+    };
+    assert( snapshot_round_trip( mutex_pool ) );
+    assert( snapshot_round_trip( ls_pool ) );
+    
+    // A journal started on a snapshot only replays on top of that snapshot - an empty pool is refused and the file left
+    // alone. A torn tail is cut off, a damaged record with journal after it isn't
+    [[maybe_unused]] auto journal_on_snapshot = [&]{
+        auto snapshot = temp + ".snapshot", path = temp + ".journal";
+        LongShortPool journaled, recovered, corrupted, empty;
+        Journal journal, reopened;
+        bool ok = ls_pool.WriteSnapshotFile( snapshot.c_str() ) && journaled.MapSnapshotFile( snapshot.c_str() );
+        auto base = journaled.tx;
+        ok = ok && journaled.Recover( path.c_str() ) == 0;
+        ok = ok && journal.Open( path.c_str(), LongShortPool::PoolKind, 0, journaled.accounts.names.size(), 0, base );
+        journaled.journal = &journal;
+        for ( int i = 0; i < 5; ++i )
+            journaled.MakeRisk( LongShortPool::Event{ i % 2 ? Side::Long : Side::Short, 50 + i }, 100 * ( i + 1 ), "journaled" + std::to_string( i ) );
+        journaled.CancelRisk( base + 1 );
+        ok = journal.Close() && ok;
+        
+        auto size = std::filesystem::file_size( path );
+        ok = empty.Recover( path.c_str() ) == Journal::Mismatch && ok;
+        ok = !reopened.Open( path.c_str(), LongShortPool::PoolKind, Journal::Mismatch ) && std::filesystem::file_size( path ) == size && ok;
+        
+        std::ofstream( path, std::ios::binary | std::ios::app ).write( "\x02\x07", 2 );
+        ok = recovered.MapSnapshotFile( snapshot.c_str() ) && recovered.Recover( path.c_str() ) == size && ok;
+        
+        std::fstream damage( path, std::ios::binary | std::ios::in | std::ios::out );
+        damage.seekp( Journal::HeaderSize + 1 );
+        damage.put( '\x7f' );
+        damage.close();
+        ok = corrupted.MapSnapshotFile( snapshot.c_str() ) && corrupted.Recover( path.c_str() ) == Journal::Corrupt && ok;
+        std::remove( path.c_str() );
+        std::remove( snapshot.c_str() );
+        return ok && same_pool( journaled, recovered );
+    };
+    assert( journal_on_snapshot() );
     
-    auto ls_pro_forma_long_check  = ls_pool.ProFormaReturnHelper( LongShortPool::Event{ Side::Long,  50}, 1000, 51 );
-    auto ls_pro_forma_short_check = ls_pool.ProFormaReturnHelper( LongShortPool::Event{ Side::Short, 50}, 1000, 49 );
+    // Loading the risks from CSV or packed rows is the same as making them one at a time - a negative amount isn't
+    // loaded either way
+    [[maybe_unused]] auto bulk_round_trip = [&]{
+        LongShortPool loaded, packed;
+        std::string csv = "side,price,amount,account\n";
+        std::vector< LongShortPool::BulkRisk > rows;
+        for ( LongShortPool::TxId id = 0; id < ls_pool.tx; ++id )
+        {
+            const auto& who = ls_pool.AccountName( ls_pool.risks.account[id] );
+            csv += std::string( ls_pool.risks.side[id] == Side::Long ? "Long" : "Short" ) + "," + std::to_string( ls_pool.risks.level[id] ) + ","
+                + std::to_string( ls_pool.risks.amount[id] ) + "," + who + "\n";
+            rows.push_back( { ls_pool.risks.side[id], ls_pool.risks.level[id], ls_pool.risks.amount[id], packed.accounts.Intern( who ) } );
+        }
+        
+        auto negative = rows;
+        negative.push_back( { Side::Long, 10, -500, rows.back().account } );
+        bool ok = packed.MakeRisks( negative ) == LongShortPool::None && loaded.LoadCsv( csv + "Long,10,-500,barney\n" ) == std::size_t( ls_pool.tx );
+        return ok && packed.MakeRisks( rows ) == 0 && same_pool( ls_pool, loaded ) && same_pool( ls_pool, packed );
+    };
+    assert( bulk_round_trip() );
     
     return 0;
 }